@@ -0,0 +1,546 @@
+/**
+ * This code simplifies triangle meshes by repeatedly collapsing the edge
+ * whose removal changes the shape the least, as measured by the quadric
+ * error metric of Garland and Heckbert.  It is used to make coarser
+ * levels of detail for meshes that are far from the camera, which are
+ * kept in binary caches next to the source files
+ */
+#ifndef MESHSIMPLIFY_H
+#define MESHSIMPLIFY_H
+
+#include <vector>
+#include <queue>
+#include <string>
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+#include "ObjMesh.h"
+
+using namespace std;
+
+#define MESH_LOD_LEVELS 3 // Levels of detail made for each mesh, not counting the mesh itself
+#define MESH_LOD_RATIO 0.25 // Fraction of the triangles of the level before that each level keeps
+#define MESH_LOD_MIN_TRIANGLES 1000 // Meshes with fewer triangles than this aren't simplified
+#define MESH_LOD_DISTANCE 10 // The first level is used this many bounding radii away
+#define MESH_LOD_BOUNDARY_WEIGHT 1000 // How strongly open boundaries are kept in place
+#define MESH_LOD_MIN_COS 0.2 // Collapses that turn a triangle further than this are skipped
+
+/**
+ * The sum of squared distances to a set of planes, stored as the upper
+ * triangle of a symmetric 4x4 matrix
+ */
+struct Quadric {
+    double a[10]; // a00 a01 a02 a03 a11 a12 a13 a22 a23 a33
+
+    /**
+     * Add the squared distance to the plane n.x + d = 0, times a weight
+     */
+    void addPlane(const double* n, double d, double w) {
+        a[0] += w*n[0]*n[0]; a[1] += w*n[0]*n[1]; a[2] += w*n[0]*n[2]; a[3] += w*n[0]*d;
+        a[4] += w*n[1]*n[1]; a[5] += w*n[1]*n[2]; a[6] += w*n[1]*d;
+        a[7] += w*n[2]*n[2]; a[8] += w*n[2]*d;
+        a[9] += w*d*d;
+    }
+
+    void add(const Quadric& other) {
+        for (int i = 0; i < 10; i++) {
+            a[i] += other.a[i];
+        }
+    }
+
+    double eval(const double* p) const {
+        double x = p[0], y = p[1], z = p[2];
+        return a[0]*x*x + 2*a[1]*x*y + 2*a[2]*x*z + 2*a[3]*x
+             + a[4]*y*y + 2*a[5]*y*z + 2*a[6]*y
+             + a[7]*z*z + 2*a[8]*z + a[9];
+    }
+
+    /**
+     * Find the point that minimizes the error
+     * @return False if the minimum isn't unique
+     */
+    bool minimize(double* p) const {
+        double det = a[0]*(a[4]*a[7] - a[5]*a[5]) - a[1]*(a[1]*a[7] - a[5]*a[2]) + a[2]*(a[1]*a[5] - a[4]*a[2]);
+        double tr = a[0] + a[4] + a[7];
+        if (fabs(det) <= 1e-9*tr*tr*tr || det == 0) {
+            return false;
+        }
+        double b[3] = {-a[3], -a[6], -a[8]};
+        p[0] = (b[0]*(a[4]*a[7] - a[5]*a[5]) - a[1]*(b[1]*a[7] - a[5]*b[2]) + a[2]*(b[1]*a[5] - a[4]*b[2]))/det;
+        p[1] = (a[0]*(b[1]*a[7] - a[5]*b[2]) - b[0]*(a[1]*a[7] - a[5]*a[2]) + a[2]*(a[1]*b[2] - b[1]*a[2]))/det;
+        p[2] = (a[0]*(a[4]*b[2] - b[1]*a[5]) - a[1]*(a[1]*b[2] - b[1]*a[2]) + b[0]*(a[1]*a[5] - a[4]*a[2]))/det;
+        return true;
+    }
+};
+
+/**
+ * A candidate edge collapse.  It's out of date if either vertex has
+ * changed since it was made
+ */
+struct EdgeCollapse {
+    double cost;
+    uint32_t a, b;
+    uint32_t versionA, versionB;
+
+    bool operator<(const EdgeCollapse& other) const {
+        return cost > other.cost; // Cheapest first in a priority_queue
+    }
+};
+
+/**
+ * Simplifies one mesh by edge collapses.  Vertices that share a position
+ * are welded first, so the simplified mesh is smooth shaded
+ */
+class MeshSimplifier {
+    private:
+        vector<double> P; // 3 per vertex
+        vector<Quadric> Q;
+        vector<uint32_t> version;
+        vector<bool> alive;
+        vector<uint32_t> T; // 3 per triangle
+        vector<bool> triAlive;
+        vector<vector<uint32_t> > vtris; // Triangles around each vertex
+        priority_queue<EdgeCollapse> heap;
+        size_t numTris;
+        vector<uint32_t> mark; // Scratch space for finding shared neighbors
+        uint32_t markCount;
+
+        static void triangleNormal(const double* p0, const double* p1, const double* p2, double* n) {
+            double u[3], v[3];
+            for (int k = 0; k < 3; k++) {
+                u[k] = p1[k] - p0[k];
+                v[k] = p2[k] - p0[k];
+            }
+            n[0] = u[1]*v[2] - u[2]*v[1];
+            n[1] = u[2]*v[0] - u[0]*v[2];
+            n[2] = u[0]*v[1] - u[1]*v[0];
+        }
+
+        /**
+         * Choose where the merged vertex of an edge goes and how much
+         * error that adds
+         */
+        double collapseTarget(uint32_t a, uint32_t b, double* p) const {
+            Quadric q = Q[a];
+            q.add(Q[b]);
+            if (q.minimize(p)) {
+                return max(0.0, q.eval(p));
+            }
+            const double* pa = &P[a*3];
+            const double* pb = &P[b*3];
+            double mid[3] = {(pa[0] + pb[0])/2, (pa[1] + pb[1])/2, (pa[2] + pb[2])/2};
+            const double* options[3] = {pa, pb, mid};
+            double best = -1;
+            for (int i = 0; i < 3; i++) {
+                double e = q.eval(options[i]);
+                if (best < 0 || e < best) {
+                    best = e;
+                    p[0] = options[i][0]; p[1] = options[i][1]; p[2] = options[i][2];
+                }
+            }
+            return max(0.0, best);
+        }
+
+        void pushEdge(uint32_t a, uint32_t b) {
+            double p[3];
+            EdgeCollapse e;
+            e.cost = collapseTarget(a, b, p);
+            e.a = a;
+            e.b = b;
+            e.versionA = version[a];
+            e.versionB = version[b];
+            heap.push(e);
+        }
+
+        /**
+         * Return true if moving a vertex to p would flip or squash any of
+         * its triangles, other than the ones that are about to disappear
+         */
+        bool flips(uint32_t v, uint32_t other, const double* p) const {
+            const vector<uint32_t>& tris = vtris[v];
+            for (size_t i = 0; i < tris.size(); i++) {
+                uint32_t t = tris[i];
+                if (!triAlive[t]) {
+                    continue;
+                }
+                const uint32_t* c = &T[t*3];
+                if (c[0] == other || c[1] == other || c[2] == other) {
+                    continue;
+                }
+                const double* q[3];
+                const double* r[3];
+                for (int k = 0; k < 3; k++) {
+                    q[k] = &P[c[k]*3];
+                    r[k] = c[k] == v ? p : q[k];
+                }
+                double n0[3], n1[3];
+                triangleNormal(q[0], q[1], q[2], n0);
+                triangleNormal(r[0], r[1], r[2], n1);
+                double l0 = sqrt(n0[0]*n0[0] + n0[1]*n0[1] + n0[2]*n0[2]);
+                double l1 = sqrt(n1[0]*n1[0] + n1[1]*n1[1] + n1[2]*n1[2]);
+                if (l1 == 0 || (l0 > 0 && n0[0]*n1[0] + n0[1]*n1[1] + n0[2]*n1[2] < MESH_LOD_MIN_COS*l0*l1)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /**
+         * Return true if collapsing an edge would keep the surface a
+         * manifold, which it does if the only vertices next to both ends
+         * are the ones across the triangles that share the edge
+         */
+        bool linkOk(uint32_t a, uint32_t b) {
+            markCount++;
+            if (markCount == 0) {
+                mark.assign(mark.size(), 0);
+                markCount = 1;
+            }
+            for (size_t i = 0; i < vtris[a].size(); i++) {
+                uint32_t t = vtris[a][i];
+                if (triAlive[t]) {
+                    for (int k = 0; k < 3; k++) {
+                        mark[T[t*3+k]] = markCount;
+                    }
+                }
+            }
+            size_t shared = 0, common = 0;
+            for (size_t i = 0; i < vtris[b].size(); i++) {
+                uint32_t t = vtris[b][i];
+                if (!triAlive[t]) {
+                    continue;
+                }
+                const uint32_t* c = &T[t*3];
+                if (c[0] == a || c[1] == a || c[2] == a) {
+                    shared++;
+                }
+                for (int k = 0; k < 3; k++) {
+                    if (c[k] != a && c[k] != b && mark[c[k]] == markCount) {
+                        mark[c[k]] = markCount - 1; // Only count each vertex once
+                        common++;
+                    }
+                }
+            }
+            return common == shared;
+        }
+
+        void collapse(uint32_t a, uint32_t b, const double* p) {
+            P[a*3] = p[0]; P[a*3+1] = p[1]; P[a*3+2] = p[2];
+            Q[a].add(Q[b]);
+            for (size_t i = 0; i < vtris[b].size(); i++) {
+                uint32_t t = vtris[b][i];
+                if (!triAlive[t]) {
+                    continue;
+                }
+                uint32_t* c = &T[t*3];
+                if (c[0] == a || c[1] == a || c[2] == a) {
+                    triAlive[t] = false;
+                    numTris--;
+                    continue;
+                }
+                for (int k = 0; k < 3; k++) {
+                    if (c[k] == b) {
+                        c[k] = a;
+                    }
+                }
+                vtris[a].push_back(t);
+            }
+            vector<uint32_t>().swap(vtris[b]);
+            alive[b] = false;
+            version[a]++;
+            // Drop the triangles that are gone and queue the new edges
+            vector<uint32_t>& tris = vtris[a];
+            size_t n = 0;
+            for (size_t i = 0; i < tris.size(); i++) {
+                if (triAlive[tris[i]]) {
+                    tris[n++] = tris[i];
+                }
+            }
+            tris.resize(n);
+            for (size_t i = 0; i < tris.size(); i++) {
+                const uint32_t* c = &T[tris[i]*3];
+                for (int k = 0; k < 3; k++) {
+                    if (c[k] != a) {
+                        pushEdge(a, c[k]);
+                    }
+                }
+            }
+        }
+
+        /**
+         * Merge vertices that share a position, drop triangles that become
+         * degenerate, and set up quadrics and candidate collapses
+         */
+        void setup(const ObjMesh& mesh) {
+            size_t nv = mesh.numVertices();
+            const vector<float>& V = mesh.positions;
+            vector<uint32_t> order(nv);
+            for (size_t i = 0; i < nv; i++) {
+                order[i] = (uint32_t)i;
+            }
+            sort(order.begin(), order.end(), [&](uint32_t i, uint32_t j) {
+                return lexicographical_compare(&V[i*3], &V[i*3+3], &V[j*3], &V[j*3+3]);
+            });
+            vector<uint32_t> weld(nv);
+            P.clear();
+            for (size_t i = 0; i < nv; i++) {
+                uint32_t v = order[i];
+                if (i == 0 || !equal(&V[v*3], &V[v*3+3], &V[order[i-1]*3])) {
+                    for (int k = 0; k < 3; k++) {
+                        P.push_back(V[v*3+k]);
+                    }
+                }
+                weld[v] = (uint32_t)(P.size()/3 - 1);
+            }
+            size_t n = P.size()/3;
+            Q.assign(n, Quadric());
+            version.assign(n, 0);
+            alive.assign(n, true);
+            mark.assign(n, 0);
+            markCount = 0;
+            vtris.assign(n, vector<uint32_t>());
+            T.clear();
+            for (size_t t = 0; t < mesh.indices.size(); t += 3) {
+                uint32_t c[3] = {weld[mesh.indices[t]], weld[mesh.indices[t+1]], weld[mesh.indices[t+2]]};
+                if (c[0] == c[1] || c[1] == c[2] || c[0] == c[2]) {
+                    continue;
+                }
+                for (int k = 0; k < 3; k++) {
+                    vtris[c[k]].push_back((uint32_t)(T.size()/3));
+                    T.push_back(c[k]);
+                }
+            }
+            numTris = T.size()/3;
+            triAlive.assign(numTris, true);
+
+            // Each triangle adds its plane to its corners, weighted by area
+            unordered_map<uint64_t, int> edgeCount;
+            for (size_t t = 0; t < numTris; t++) {
+                const uint32_t* c = &T[t*3];
+                double nrm[3];
+                triangleNormal(&P[c[0]*3], &P[c[1]*3], &P[c[2]*3], nrm);
+                double len = sqrt(nrm[0]*nrm[0] + nrm[1]*nrm[1] + nrm[2]*nrm[2]);
+                if (len == 0) {
+                    continue;
+                }
+                double u[3] = {nrm[0]/len, nrm[1]/len, nrm[2]/len};
+                double d = -(u[0]*P[c[0]*3] + u[1]*P[c[0]*3+1] + u[2]*P[c[0]*3+2]);
+                for (int k = 0; k < 3; k++) {
+                    Q[c[k]].addPlane(u, d, len/2);
+                    uint32_t lo = min(c[k], c[(k+1)%3]), hi = max(c[k], c[(k+1)%3]);
+                    edgeCount[((uint64_t)lo << 32) | hi]++;
+                }
+            }
+            // Edges on an open boundary also get a plane through them that's
+            // perpendicular to their triangle, so the boundary doesn't shrink
+            for (size_t t = 0; t < numTris; t++) {
+                const uint32_t* c = &T[t*3];
+                for (int k = 0; k < 3; k++) {
+                    uint32_t a = c[k], b = c[(k+1)%3];
+                    uint64_t key = ((uint64_t)min(a, b) << 32) | max(a, b);
+                    if (edgeCount[key] != 1) {
+                        continue;
+                    }
+                    double nrm[3], e[3], u[3];
+                    triangleNormal(&P[c[0]*3], &P[c[1]*3], &P[c[2]*3], nrm);
+                    for (int j = 0; j < 3; j++) {
+                        e[j] = P[b*3+j] - P[a*3+j];
+                    }
+                    u[0] = e[1]*nrm[2] - e[2]*nrm[1];
+                    u[1] = e[2]*nrm[0] - e[0]*nrm[2];
+                    u[2] = e[0]*nrm[1] - e[1]*nrm[0];
+                    double len = sqrt(u[0]*u[0] + u[1]*u[1] + u[2]*u[2]);
+                    if (len == 0) {
+                        continue;
+                    }
+                    u[0] /= len; u[1] /= len; u[2] /= len;
+                    double d = -(u[0]*P[a*3] + u[1]*P[a*3+1] + u[2]*P[a*3+2]);
+                    double w = MESH_LOD_BOUNDARY_WEIGHT*(e[0]*e[0] + e[1]*e[1] + e[2]*e[2]);
+                    Q[a].addPlane(u, d, w);
+                    Q[b].addPlane(u, d, w);
+                }
+            }
+            heap = priority_queue<EdgeCollapse>();
+            for (unordered_map<uint64_t, int>::iterator it = edgeCount.begin(); it != edgeCount.end(); it++) {
+                pushEdge((uint32_t)(it->first >> 32), (uint32_t)(it->first & 0xFFFFFFFF));
+            }
+        }
+
+    public:
+        MeshSimplifier() {
+            numTris = 0;
+            markCount = 0;
+        }
+
+        /**
+         * Start simplifying a mesh
+         */
+        void begin(const ObjMesh& mesh) {
+            setup(mesh);
+        }
+
+        /**
+         * Collapse edges until there are at most a number of triangles left,
+         * or until no more edges can be collapsed without folding the
+         * surface over.  This can be called again with a smaller target
+         * to continue where it left off
+         * @param target Number of triangles to stop at
+         */
+        void reduce(size_t target) {
+            double p[3];
+            while (numTris > target && !heap.empty()) {
+                EdgeCollapse e = heap.top();
+                heap.pop();
+                if (!alive[e.a] || !alive[e.b] || version[e.a] != e.versionA || version[e.b] != e.versionB) {
+                    continue;
+                }
+                collapseTarget(e.a, e.b, p);
+                if (!linkOk(e.a, e.b) || flips(e.a, e.b, p) || flips(e.b, e.a, p)) {
+                    continue;
+                }
+                collapse(e.a, e.b, p);
+            }
+        }
+
+        size_t getNumTriangles() const {
+            return numTris;
+        }
+
+        /**
+         * Copy out the triangles that are left, with smooth vertex normals
+         */
+        void getMesh(ObjMesh& mesh) const {
+            vector<uint32_t> slot(alive.size(), 0xFFFFFFFF);
+            mesh.positions.clear();
+            mesh.indices.clear();
+            for (size_t t = 0; t < triAlive.size(); t++) {
+                if (!triAlive[t]) {
+                    continue;
+                }
+                for (int k = 0; k < 3; k++) {
+                    uint32_t v = T[t*3+k];
+                    if (slot[v] == 0xFFFFFFFF) {
+                        slot[v] = (uint32_t)(mesh.positions.size()/3);
+                        for (int j = 0; j < 3; j++) {
+                            mesh.positions.push_back((float)P[v*3+j]);
+                        }
+                    }
+                    mesh.indices.push_back(slot[v]);
+                }
+            }
+            computeVertexNormals(mesh);
+            computeBounds(mesh);
+        }
+};
+
+/**
+ * Return the path of the binary cache of one level of detail of a mesh
+ * @param path Path to the OBJ file
+ * @param level The level, starting at 1 for the first simplified one
+ */
+inline string getMeshLodPath(const string& path, int level) {
+    stringstream ss;
+    ss << path << ".lod" << level << MESH_CACHE_EXTENSION;
+    return ss.str();
+}
+
+/**
+ * Make sure the simplified levels of detail of an OBJ file are up to date,
+ * rebuilding them with the same rules as updateMeshCache.  Each level
+ * keeps MESH_LOD_RATIO of the triangles of the one before it.  Meshes with
+ * fewer than MESH_LOD_MIN_TRIANGLES triangles get no levels.  The binary
+ * cache of the full mesh is brought up to date first, and is what the
+ * levels are simplified from; its header says how many triangles the mesh
+ * has, so small meshes are known to need no levels without reading them
+ * @param path Path to the OBJ file
+ * @param lodPaths Filled with the paths of the levels, from most to least detailed
+ * @param radius Filled with the radius of the full mesh's bounding box
+ * @return True if the levels (if any) are up to date
+ */
+inline bool updateMeshLods(const string& path, vector<string>& lodPaths, double& radius) {
+    lodPaths.clear();
+    radius = 0;
+    string cachePath = getMeshCachePath(path);
+    float lo[3], hi[3];
+    SourceStamp src;
+    uint32_t nv, nt;
+    if (!updateMeshCache(path, lo, hi) || !readMeshCacheHeader(cachePath, src, nv, nt, lo, hi)) {
+        return false;
+    }
+    if (nt < MESH_LOD_MIN_TRIANGLES) {
+        return true;
+    }
+    bool fresh = true;
+    for (int level = 1; level <= MESH_LOD_LEVELS && fresh; level++) {
+        float levelLo[3], levelHi[3];
+        bool touched;
+        fresh = isMeshCacheFresh(path, getMeshLodPath(path, level), src, levelLo, levelHi, &touched);
+        if (touched) {
+            refreshMeshCacheStamp(getMeshLodPath(path, level), src);
+        }
+    }
+    if (!fresh) {
+        ObjMesh mesh;
+        if (!readMeshCache(cachePath, mesh)) {
+            return false;
+        }
+        MeshSimplifier simplifier;
+        simplifier.begin(mesh);
+        double target = (double)mesh.numTriangles();
+        for (int level = 1; level <= MESH_LOD_LEVELS; level++) {
+            target *= MESH_LOD_RATIO;
+            simplifier.reduce((size_t)target);
+            ObjMesh simple;
+            simplifier.getMesh(simple);
+            if (!writeMeshCache(getMeshLodPath(path, level), simple, src)) {
+                return false;
+            }
+        }
+    }
+    for (int level = 1; level <= MESH_LOD_LEVELS; level++) {
+        lodPaths.push_back(getMeshLodPath(path, level));
+    }
+    double d2 = 0;
+    for (int k = 0; k < 3; k++) {
+        d2 += (hi[k] - lo[k])*(hi[k] - lo[k]);
+    }
+    radius = sqrt(d2)/2;
+    return true;
+}
+
+/**
+ * Bring the levels of detail of many OBJ files up to date, simplifying
+ * different files on different threads
+ * @param paths Paths to the OBJ files
+ * @param lodPaths Filled with the paths of the levels of each file (see updateMeshLods)
+ * @param radii Filled with the radius of the bounding box of each file
+ * @param numThreads Number of threads to use, or 0 to use one per core
+ */
+inline void updateMeshLods(const vector<string>& paths, vector<vector<string> >& lodPaths,
+                           vector<double>& radii, unsigned numThreads = 0) {
+    if (numThreads == 0) {
+        numThreads = max(1u, thread::hardware_concurrency());
+    }
+    numThreads = (unsigned)min((size_t)numThreads, max((size_t)1, paths.size()));
+    lodPaths.assign(paths.size(), vector<string>());
+    radii.assign(paths.size(), 0);
+    atomic<size_t> next(0);
+    auto work = [&]() {
+        for (size_t i = next++; i < paths.size(); i = next++) {
+            updateMeshLods(paths[i], lodPaths[i], radii[i]);
+        }
+    };
+    vector<thread> threads;
+    for (unsigned t = 1; t < numThreads; t++) {
+        threads.push_back(thread(work));
+    }
+    work();
+    for (size_t t = 0; t < threads.size(); t++) {
+        threads[t].join();
+    }
+}
+
+#endif
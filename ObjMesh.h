@@ -0,0 +1,928 @@
+/**
+ * This code reads triangle meshes from OBJ and OFF files, writes them
+ * back out as OBJ, and keeps compact binary caches of them next to the
+ * source files
+ */
+#ifndef OBJMESH_H
+#define OBJMESH_H
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <unordered_map>
+#include <thread>
+#include <functional>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "SceneWriter.h"
+
+using namespace std;
+
+#define MESH_CACHE_MAGIC "S3DM"
+#define MESH_CACHE_VERSION 1
+#define MESH_CACHE_EXTENSION ".s3dm"
+#define MESH_CACHE_HEADER_SIZE 64
+
+/**
+ * An indexed triangle mesh with one normal per vertex
+ */
+struct ObjMesh {
+    vector<float> positions; // 3 per vertex
+    vector<float> normals; // 3 per vertex
+    vector<uint32_t> indices; // 3 per triangle
+    float bmin[3], bmax[3]; // Axis-aligned bounding box of the positions
+
+    size_t numVertices() const {
+        return positions.size()/3;
+    }
+
+    size_t numTriangles() const {
+        return indices.size()/3;
+    }
+};
+
+/**
+ * Identifies the version of a source file that a cache was built from
+ */
+struct SourceStamp {
+    uint64_t size;
+    int64_t mtime;
+    uint64_t hash;
+};
+
+/**
+ * A read-only view of a whole file.  The file is memory mapped where
+ * possible, and read into memory otherwise
+ */
+class MappedFile {
+    private:
+        const char* ptr;
+        size_t len;
+        vector<char> buffer;
+        bool mapped;
+
+        MappedFile(const MappedFile&);
+        MappedFile& operator=(const MappedFile&);
+
+    public:
+        MappedFile() {
+            ptr = NULL;
+            len = 0;
+            mapped = false;
+        }
+
+        ~MappedFile() {
+            close();
+        }
+
+        /**
+         * Open a file
+         * @param path Path to the file
+         * @return True if the file could be opened
+         */
+        bool open(const string& path) {
+            close();
+#ifndef _WIN32
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return false;
+            }
+            struct stat st;
+            if (fstat(fd, &st) != 0) {
+                ::close(fd);
+                return false;
+            }
+            len = (size_t)st.st_size;
+            if (len > 0) {
+                void* p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    ptr = (const char*)p;
+                    mapped = true;
+                }
+            }
+            ::close(fd);
+            if (mapped || len == 0) {
+                return true;
+            }
+#endif
+            ifstream in(path.c_str(), ios::binary);
+            if (!in) {
+                return false;
+            }
+            in.seekg(0, ios::end);
+            len = (size_t)in.tellg();
+            in.seekg(0, ios::beg);
+            buffer.resize(len);
+            if (len > 0) {
+                in.read(&buffer[0], len);
+            }
+            ptr = len > 0 ? &buffer[0] : NULL;
+            return true;
+        }
+
+        void close() {
+#ifndef _WIN32
+            if (mapped) {
+                munmap((void*)ptr, len);
+            }
+#endif
+            mapped = false;
+            ptr = NULL;
+            len = 0;
+            buffer.clear();
+        }
+
+        const char* data() const {
+            return ptr;
+        }
+
+        size_t size() const {
+            return len;
+        }
+};
+
+/**
+ * Compute the 64-bit FNV-1a hash of a block of memory
+ */
+inline uint64_t hashBytes(const char* data, size_t len, uint64_t h = 14695981039346656037ULL) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/**
+ * Get the size and modification time of a file
+ * @return True if the file exists
+ */
+inline bool getFileStamp(const string& path, SourceStamp& stamp) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return false;
+    }
+    stamp.size = (uint64_t)st.st_size;
+    stamp.mtime = (int64_t)st.st_mtime;
+    stamp.hash = 0;
+    return true;
+}
+
+/**
+ * Parse a decimal number starting at p without allocating, and advance
+ * p past it.  Handles an optional sign, fraction and exponent
+ */
+inline double parseNumber(const char*& p, const char* end) {
+    static const double POW10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+                                   1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    bool neg = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        neg = *p == '-';
+        p++;
+    }
+    uint64_t mant = 0;
+    int exp10 = 0;
+    int digits = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        if (digits < 19) {
+            mant = mant*10 + (*p - '0');
+            digits += mant > 0;
+        }
+        else {
+            exp10++;
+        }
+        p++;
+    }
+    if (p < end && *p == '.') {
+        p++;
+        while (p < end && *p >= '0' && *p <= '9') {
+            if (digits < 19) {
+                mant = mant*10 + (*p - '0');
+                digits += mant > 0;
+                exp10--;
+            }
+            p++;
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        bool eneg = false;
+        if (p < end && (*p == '-' || *p == '+')) {
+            eneg = *p == '-';
+            p++;
+        }
+        int e = 0;
+        while (p < end && *p >= '0' && *p <= '9') {
+            if (e < 10000) {
+                e = e*10 + (*p - '0');
+            }
+            p++;
+        }
+        exp10 += eneg ? -e : e;
+    }
+    double x = (double)mant;
+    if (exp10 < 0) {
+        x = -exp10 <= 22 ? x/POW10[-exp10] : x*pow(10.0, exp10);
+    }
+    else if (exp10 > 0) {
+        x = exp10 <= 22 ? x*POW10[exp10] : x*pow(10.0, exp10);
+    }
+    return neg ? -x : x;
+}
+
+/**
+ * Parse an integer starting at p without allocating, and advance p past it
+ */
+inline long parseInt(const char*& p, const char* end) {
+    bool neg = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        neg = *p == '-';
+        p++;
+    }
+    long x = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        x = x*10 + (*p - '0');
+        p++;
+    }
+    return neg ? -x : x;
+}
+
+/**
+ * Compute area-weighted vertex normals for a mesh
+ */
+inline void computeVertexNormals(ObjMesh& mesh) {
+    size_t nv = mesh.numVertices();
+    const vector<float>& P = mesh.positions;
+    mesh.normals.assign(nv*3, 0.0f);
+    for (size_t t = 0; t < mesh.indices.size(); t += 3) {
+        uint32_t a = mesh.indices[t], b = mesh.indices[t+1], c = mesh.indices[t+2];
+        float u[3], v[3];
+        for (int k = 0; k < 3; k++) {
+            u[k] = P[b*3+k] - P[a*3+k];
+            v[k] = P[c*3+k] - P[a*3+k];
+        }
+        float n[3] = {u[1]*v[2] - u[2]*v[1], u[2]*v[0] - u[0]*v[2], u[0]*v[1] - u[1]*v[0]};
+        for (int k = 0; k < 3; k++) {
+            mesh.normals[a*3+k] += n[k];
+            mesh.normals[b*3+k] += n[k];
+            mesh.normals[c*3+k] += n[k];
+        }
+    }
+    for (size_t i = 0; i < nv; i++) {
+        float* n = &mesh.normals[i*3];
+        float mag = sqrtf(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+        if (mag > 0) {
+            n[0] /= mag;
+            n[1] /= mag;
+            n[2] /= mag;
+        }
+    }
+}
+
+/**
+ * Compute the bounding box of a mesh's positions
+ */
+inline void computeBounds(ObjMesh& mesh) {
+    for (int k = 0; k < 3; k++) {
+        mesh.bmin[k] = mesh.positions.size() > 0 ? mesh.positions[k] : 0;
+        mesh.bmax[k] = mesh.bmin[k];
+    }
+    for (size_t i = 0; i < mesh.positions.size(); i += 3) {
+        for (int k = 0; k < 3; k++) {
+            float x = mesh.positions[i+k];
+            if (x < mesh.bmin[k]) mesh.bmin[k] = x;
+            if (x > mesh.bmax[k]) mesh.bmax[k] = x;
+        }
+    }
+}
+
+/**
+ * Move a mesh so that the mean of its vertices is at the origin, and
+ * scale it so that the mean squared distance of its vertices from the
+ * origin is 1.  Normals don't change under a uniform scale, so they're
+ * kept as they are
+ */
+inline void normalizeMesh(ObjMesh& mesh) {
+    size_t nv = mesh.numVertices();
+    if (nv == 0) {
+        return;
+    }
+    double mean[3] = {0, 0, 0};
+    for (size_t i = 0; i < nv; i++) {
+        for (int k = 0; k < 3; k++) {
+            mean[k] += mesh.positions[i*3+k];
+        }
+    }
+    for (int k = 0; k < 3; k++) {
+        mean[k] /= nv;
+    }
+    double sumSqr = 0;
+    for (size_t i = 0; i < nv; i++) {
+        for (int k = 0; k < 3; k++) {
+            double x = mesh.positions[i*3+k] - mean[k];
+            sumSqr += x*x;
+        }
+    }
+    double scale = sumSqr > 0 ? sqrt(nv/sumSqr) : 1;
+    for (size_t i = 0; i < nv; i++) {
+        for (int k = 0; k < 3; k++) {
+            mesh.positions[i*3+k] = (float)((mesh.positions[i*3+k] - mean[k])*scale);
+        }
+    }
+    computeBounds(mesh);
+}
+
+/**
+ * Parse the vertices, normals and faces of an OBJ file that has been
+ * loaded into memory.  Polygons are triangulated as fans, and vertices
+ * that are used with more than one normal are split.  If the file has
+ * no normals, area-weighted vertex normals are computed
+ * @param data Contents of the file
+ * @param len Length of the contents in bytes
+ * @param mesh Mesh to fill in
+ * @return True if the file had at least one face
+ */
+inline bool parseObj(const char* data, size_t len, ObjMesh& mesh) {
+    const char* p = data;
+    const char* end = data + len;
+    vector<float> V, N;
+    vector<long> corners; // (vertex, normal) index pairs, 0-based, -1 for no normal
+    vector<long> face;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        if (p + 1 < end && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+            p += 2;
+            for (int k = 0; k < 3; k++) {
+                while (p < end && (*p == ' ' || *p == '\t')) p++;
+                V.push_back((float)parseNumber(p, end));
+            }
+        }
+        else if (p + 2 < end && p[0] == 'v' && p[1] == 'n' && (p[2] == ' ' || p[2] == '\t')) {
+            p += 3;
+            for (int k = 0; k < 3; k++) {
+                while (p < end && (*p == ' ' || *p == '\t')) p++;
+                N.push_back((float)parseNumber(p, end));
+            }
+        }
+        else if (p + 1 < end && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+            p += 2;
+            face.clear();
+            long nv = (long)V.size()/3, nn = (long)N.size()/3;
+            while (true) {
+                while (p < end && (*p == ' ' || *p == '\t')) p++;
+                if (p >= end || !(*p == '-' || (*p >= '0' && *p <= '9'))) {
+                    break;
+                }
+                long vi = parseInt(p, end);
+                long ni = 0;
+                if (p < end && *p == '/') {
+                    p++;
+                    if (p < end && *p != '/') {
+                        parseInt(p, end); // Texture coordinate, unused
+                    }
+                    if (p < end && *p == '/') {
+                        p++;
+                        ni = parseInt(p, end);
+                    }
+                }
+                face.push_back(vi < 0 ? nv + vi : vi - 1);
+                face.push_back(ni == 0 ? -1 : (ni < 0 ? nn + ni : ni - 1));
+            }
+            for (size_t k = 2; k*2 < face.size(); k++) {
+                corners.push_back(face[0]);
+                corners.push_back(face[1]);
+                corners.push_back(face[(k-1)*2]);
+                corners.push_back(face[(k-1)*2+1]);
+                corners.push_back(face[k*2]);
+                corners.push_back(face[k*2+1]);
+            }
+        }
+        while (p < end && *p != '\n') p++;
+        p++;
+    }
+
+    // Assign an output vertex to every (vertex, normal) pair.  In the common
+    // case each vertex is only used with one normal, so no lookup is needed
+    size_t nv = V.size()/3;
+    size_t nn = N.size()/3;
+    bool hasNormals = nn > 0;
+    vector<uint32_t> slot(nv, 0xFFFFFFFF);
+    vector<long> slotNormal(nv, -1);
+    unordered_map<uint64_t, uint32_t> splits;
+    mesh.positions.clear();
+    mesh.normals.clear();
+    mesh.indices.clear();
+    mesh.indices.reserve(corners.size()/2);
+    for (size_t c = 0; c < corners.size(); c += 2) {
+        long vi = corners[c], ni = corners[c+1];
+        if (vi < 0 || vi >= (long)nv) {
+            return false;
+        }
+        if (ni >= (long)nn) {
+            ni = -1;
+        }
+        uint32_t idx;
+        if (slot[vi] == 0xFFFFFFFF || slotNormal[vi] != ni) {
+            uint64_t key = ((uint64_t)vi << 32) | (uint32_t)(ni + 1);
+            if (slot[vi] != 0xFFFFFFFF) {
+                unordered_map<uint64_t, uint32_t>::iterator it = splits.find(key);
+                if (it != splits.end()) {
+                    mesh.indices.push_back(it->second);
+                    continue;
+                }
+            }
+            idx = (uint32_t)(mesh.positions.size()/3);
+            for (int k = 0; k < 3; k++) {
+                mesh.positions.push_back(V[vi*3+k]);
+                if (hasNormals) {
+                    mesh.normals.push_back(ni >= 0 ? N[ni*3+k] : 0.0f);
+                }
+            }
+            if (slot[vi] == 0xFFFFFFFF) {
+                slot[vi] = idx;
+                slotNormal[vi] = ni;
+            }
+            else {
+                splits[key] = idx;
+            }
+        }
+        else {
+            idx = slot[vi];
+        }
+        mesh.indices.push_back(idx);
+    }
+    if (!hasNormals) {
+        computeVertexNormals(mesh);
+    }
+    computeBounds(mesh);
+    return mesh.indices.size() > 0;
+}
+
+/**
+ * Read a triangle mesh from an OBJ file
+ * @param path Path to the OBJ file
+ * @param mesh Mesh to fill in
+ * @param stamp If not NULL, filled with the size, modification time
+ *              and hash of the file
+ * @return True if the file could be read and had at least one face
+ */
+inline bool readObj(const string& path, ObjMesh& mesh, SourceStamp* stamp = NULL) {
+    MappedFile file;
+    if (!file.open(path)) {
+        return false;
+    }
+    if (stamp != NULL) {
+        getFileStamp(path, *stamp);
+        stamp->hash = hashBytes(file.data(), file.size());
+    }
+    return parseObj(file.data(), file.size(), mesh);
+}
+
+/**
+ * Parse an OFF file that has been loaded into memory.  The vertex and face
+ * counts can be on the line after the OFF (or COFF, NOFF, ...) keyword or
+ * on the same line, and anything after the position of a vertex or the
+ * corners of a face (colors, normals) is ignored.  Polygons are
+ * triangulated as fans, and area-weighted vertex normals are computed
+ * @param data Contents of the file
+ * @param len Length of the contents in bytes
+ * @param mesh Mesh to fill in
+ * @return True if the file was well formed and had at least one face
+ */
+inline bool parseOff(const char* data, size_t len, ObjMesh& mesh) {
+    const char* p = data;
+    const char* end = data + len;
+    // Skip whitespace, and comments through the end of their line
+    auto skipSpace = [&]() {
+        while (p < end) {
+            if (*p == '#') {
+                while (p < end && *p != '\n') p++;
+            }
+            else if (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+                p++;
+            }
+            else {
+                break;
+            }
+        }
+    };
+    auto skipLine = [&]() {
+        while (p < end && *p != '\n') p++;
+    };
+    skipSpace();
+    if (p < end && !(*p >= '0' && *p <= '9')) {
+        const char* word = p;
+        while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+        if (p - word < 3 || strncmp(p - 3, "OFF", 3) != 0) {
+            return false;
+        }
+    }
+    long counts[3];
+    for (int k = 0; k < 3; k++) {
+        skipSpace();
+        counts[k] = parseInt(p, end);
+    }
+    skipLine();
+    if (counts[0] <= 0 || counts[1] <= 0 || counts[0] > 0xFFFFFFFFL) {
+        return false;
+    }
+    size_t nv = (size_t)counts[0], nf = (size_t)counts[1];
+    mesh.positions.resize(nv*3);
+    for (size_t i = 0; i < nv; i++) {
+        skipSpace();
+        for (int k = 0; k < 3; k++) {
+            while (p < end && (*p == ' ' || *p == '\t')) p++;
+            mesh.positions[i*3+k] = (float)parseNumber(p, end);
+        }
+        if (p >= end) {
+            return false;
+        }
+        skipLine();
+    }
+    mesh.indices.clear();
+    mesh.indices.reserve(nf*3);
+    for (size_t f = 0; f < nf; f++) {
+        skipSpace();
+        if (p >= end) {
+            return false;
+        }
+        long n = parseInt(p, end);
+        long first = 0, prev = 0;
+        for (long c = 0; c < n; c++) {
+            while (p < end && (*p == ' ' || *p == '\t')) p++;
+            long v = parseInt(p, end);
+            if (v < 0 || v >= counts[0]) {
+                return false;
+            }
+            if (c == 0) {
+                first = v;
+            }
+            else if (c >= 2) {
+                mesh.indices.push_back((uint32_t)first);
+                mesh.indices.push_back((uint32_t)prev);
+                mesh.indices.push_back((uint32_t)v);
+            }
+            prev = v;
+        }
+        skipLine();
+    }
+    computeVertexNormals(mesh);
+    computeBounds(mesh);
+    return mesh.indices.size() > 0;
+}
+
+/**
+ * Read a triangle mesh from an OFF file
+ * @param path Path to the OFF file
+ * @param mesh Mesh to fill in
+ * @param stamp If not NULL, filled with the size, modification time
+ *              and hash of the file
+ * @return True if the file could be read and had at least one face
+ */
+inline bool readOff(const string& path, ObjMesh& mesh, SourceStamp* stamp = NULL) {
+    MappedFile file;
+    if (!file.open(path)) {
+        return false;
+    }
+    if (stamp != NULL) {
+        getFileStamp(path, *stamp);
+        stamp->hash = hashBytes(file.data(), file.size());
+    }
+    return parseOff(file.data(), file.size(), mesh);
+}
+
+/**
+ * Write a mesh to an OBJ file the way the meshes in meshes/ are laid out:
+ * a comment header with the name and counts, each vertex's position
+ * followed by its normal, then faces that use the same index for both
+ * @param path Path of the OBJ file
+ * @param mesh Mesh to write
+ * @param name Name to give the object in the header
+ * @return True if the file was written
+ */
+inline bool writeObj(const string& path, const ObjMesh& mesh, const string& name) {
+    SceneWriter out;
+    if (!out.open(path)) {
+        return false;
+    }
+    out << "# object name: " << name << "\n";
+    out << "# number of vertices: " << mesh.numVertices() << "\n";
+    out << "# number of triangles: " << mesh.numTriangles() << "\n";
+    const vector<float>& P = mesh.positions;
+    const vector<float>& N = mesh.normals;
+    for (size_t i = 0; i < P.size(); i += 3) {
+        out << "v " << (double)P[i] << ' ' << (double)P[i+1] << ' ' << (double)P[i+2] << "\n";
+        out << "vn " << (double)N[i] << ' ' << (double)N[i+1] << ' ' << (double)N[i+2] << "\n";
+    }
+    for (size_t t = 0; t < mesh.indices.size(); t += 3) {
+        out << 'f';
+        for (int k = 0; k < 3; k++) {
+            unsigned long v = mesh.indices[t+k] + 1UL;
+            out << ' ' << v << "//" << v;
+        }
+        out << "\n";
+    }
+    return out.close();
+}
+
+/**
+ * Return a name for a temporary file next to a file, that no other
+ * process or thread writing the same file at the same time will use
+ */
+inline string getTempPath(const string& path) {
+#ifdef _WIN32
+    long pid = (long)_getpid();
+#else
+    long pid = (long)getpid();
+#endif
+    char suffix[64];
+    snprintf(suffix, sizeof(suffix), ".%ld_%zx.tmp", pid, hash<thread::id>()(this_thread::get_id()));
+    return path + suffix;
+}
+
+/**
+ * Return the path of the binary cache for a mesh file
+ */
+inline string getMeshCachePath(const string& path) {
+    return path + MESH_CACHE_EXTENSION;
+}
+
+/**
+ * Write a mesh to a binary cache file.  The layout is a 64 byte header
+ * (magic, version, source size, mtime and hash, vertex and triangle
+ * counts, bounding box) followed by float32 positions, float32 normals
+ * and uint32 indices, all little endian
+ * @param cachePath Path of the cache file
+ * @param mesh Mesh to write
+ * @param stamp Identifies the source the mesh was read from
+ * @return True if the file was written
+ */
+inline bool writeMeshCache(const string& cachePath, const ObjMesh& mesh, const SourceStamp& stamp) {
+    char header[MESH_CACHE_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    uint32_t version = MESH_CACHE_VERSION;
+    uint32_t nv = (uint32_t)mesh.numVertices();
+    uint32_t nt = (uint32_t)mesh.numTriangles();
+    memcpy(header, MESH_CACHE_MAGIC, 4);
+    memcpy(header + 4, &version, 4);
+    memcpy(header + 8, &stamp.size, 8);
+    memcpy(header + 16, &stamp.mtime, 8);
+    memcpy(header + 24, &stamp.hash, 8);
+    memcpy(header + 32, &nv, 4);
+    memcpy(header + 36, &nt, 4);
+    memcpy(header + 40, mesh.bmin, 12);
+    memcpy(header + 52, mesh.bmax, 12);
+    // Write to a temporary file first so a reader never sees a partial cache
+    string tmpPath = getTempPath(cachePath);
+    ofstream out(tmpPath.c_str(), ios::binary);
+    if (!out) {
+        return false;
+    }
+    out.write(header, sizeof(header));
+    out.write((const char*)&mesh.positions[0], mesh.positions.size()*sizeof(float));
+    out.write((const char*)&mesh.normals[0], mesh.normals.size()*sizeof(float));
+    out.write((const char*)&mesh.indices[0], mesh.indices.size()*sizeof(uint32_t));
+    out.close();
+    if (!out) {
+        remove(tmpPath.c_str());
+        return false;
+    }
+    if (rename(tmpPath.c_str(), cachePath.c_str()) != 0) {
+        remove(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Read the header of a binary mesh cache
+ * @return True if the file exists and has a valid header
+ */
+inline bool readMeshCacheHeader(const string& cachePath, SourceStamp& stamp, uint32_t& nv, uint32_t& nt, float* bmin, float* bmax) {
+    ifstream in(cachePath.c_str(), ios::binary);
+    char header[MESH_CACHE_HEADER_SIZE];
+    if (!in.read(header, sizeof(header))) {
+        return false;
+    }
+    uint32_t version;
+    memcpy(&version, header + 4, 4);
+    if (memcmp(header, MESH_CACHE_MAGIC, 4) != 0 || version != MESH_CACHE_VERSION) {
+        return false;
+    }
+    memcpy(&stamp.size, header + 8, 8);
+    memcpy(&stamp.mtime, header + 16, 8);
+    memcpy(&stamp.hash, header + 24, 8);
+    memcpy(&nv, header + 32, 4);
+    memcpy(&nt, header + 36, 4);
+    memcpy(bmin, header + 40, 12);
+    memcpy(bmax, header + 52, 12);
+    return true;
+}
+
+/**
+ * Read a mesh back from a binary cache file
+ * @return True if the file could be read
+ */
+inline bool readMeshCache(const string& cachePath, ObjMesh& mesh) {
+    SourceStamp stamp;
+    uint32_t nv, nt;
+    if (!readMeshCacheHeader(cachePath, stamp, nv, nt, mesh.bmin, mesh.bmax)) {
+        return false;
+    }
+    MappedFile file;
+    if (!file.open(cachePath)) {
+        return false;
+    }
+    size_t expected = MESH_CACHE_HEADER_SIZE + (size_t)nv*24 + (size_t)nt*12;
+    if (file.size() != expected) {
+        return false;
+    }
+    const char* p = file.data() + MESH_CACHE_HEADER_SIZE;
+    mesh.positions.resize((size_t)nv*3);
+    mesh.normals.resize((size_t)nv*3);
+    mesh.indices.resize((size_t)nt*3);
+    memcpy(&mesh.positions[0], p, (size_t)nv*12);
+    memcpy(&mesh.normals[0], p + (size_t)nv*12, (size_t)nv*12);
+    memcpy(&mesh.indices[0], p + (size_t)nv*24, (size_t)nt*12);
+    return true;
+}
+
+/**
+ * Check whether a binary cache built from a source file is up to date.
+ * It is if the source has the size and mtime the cache was built from, or
+ * if only its mtime changed and its contents hash the same.  The cache
+ * isn't changed; see refreshMeshCacheStamp
+ * @param path Path to the source file
+ * @param cachePath Path to the cache file
+ * @param src Size and mtime of the source file
+ * @param lo Filled with the minimum corner of the cached mesh's bounding box
+ * @param hi Filled with the maximum corner of the cached mesh's bounding box
+ * @param touched If not NULL, set to true if the cache is up to date but
+ *                has an old mtime, and to false otherwise
+ * @return True if the cache exists and is up to date
+ */
+inline bool isMeshCacheFresh(const string& path, const string& cachePath, const SourceStamp& src, float* lo, float* hi,
+                             bool* touched = NULL) {
+    if (touched != NULL) {
+        *touched = false;
+    }
+    SourceStamp cached;
+    uint32_t nv, nt;
+    if (!readMeshCacheHeader(cachePath, cached, nv, nt, lo, hi) || cached.size != src.size) {
+        return false;
+    }
+    if (cached.mtime == src.mtime) {
+        return true;
+    }
+    // The file was touched; only rebuild if its contents changed
+    MappedFile file;
+    if (file.open(path) && hashBytes(file.data(), file.size()) == cached.hash) {
+        if (touched != NULL) {
+            *touched = true;
+        }
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Give an up to date cache the mtime of a source file that was touched
+ * since, so that the next check doesn't have to hash the source.  The
+ * cache is rewritten whole through a temporary file, like writeMeshCache,
+ * so that readers never see it half changed
+ * @param cachePath Path to the cache file
+ * @param src Size and mtime of the source file
+ * @return True if the cache was rewritten
+ */
+inline bool refreshMeshCacheStamp(const string& cachePath, const SourceStamp& src) {
+    SourceStamp stamp;
+    uint32_t nv, nt;
+    float lo[3], hi[3];
+    ObjMesh mesh;
+    if (!readMeshCacheHeader(cachePath, stamp, nv, nt, lo, hi) || !readMeshCache(cachePath, mesh)) {
+        return false;
+    }
+    stamp.mtime = src.mtime;
+    return writeMeshCache(cachePath, mesh, stamp);
+}
+
+/**
+ * Make sure the binary cache of an OBJ file is up to date, rebuilding it
+ * only if the source's size and mtime changed and its contents hash
+ * differs from the one the cache was built from
+ * @param path Path to the OBJ file
+ * @param bmin If not NULL, filled with the minimum corner of the mesh's bounding box
+ * @param bmax If not NULL, filled with the maximum corner of the mesh's bounding box
+ * @return True if the cache exists and is up to date
+ */
+inline bool updateMeshCache(const string& path, float* bmin = NULL, float* bmax = NULL) {
+    string cachePath = getMeshCachePath(path);
+    SourceStamp src;
+    if (!getFileStamp(path, src)) {
+        return false;
+    }
+    float lo[3], hi[3];
+    bool touched;
+    if (isMeshCacheFresh(path, cachePath, src, lo, hi, &touched)) {
+        if (touched) {
+            // If this fails, the cache is still right, and the next check
+            // just hashes the source again
+            refreshMeshCacheStamp(cachePath, src);
+        }
+    }
+    else {
+        ObjMesh mesh;
+        if (!readObj(path, mesh, &src) || !writeMeshCache(cachePath, mesh, src)) {
+            return false;
+        }
+        memcpy(lo, mesh.bmin, 12);
+        memcpy(hi, mesh.bmax, 12);
+    }
+    if (bmin != NULL) {
+        memcpy(bmin, lo, 12);
+    }
+    if (bmax != NULL) {
+        memcpy(bmax, hi, 12);
+    }
+    return true;
+}
+
+/**
+ * Find the bounding box of a mesh file, from the header of its binary
+ * cache if that's up to date, or by reading the mesh otherwise
+ * @param path Path to the OBJ file
+ * @param bmin Filled with the minimum corner of the bounding box
+ * @param bmax Filled with the maximum corner of the bounding box
+ * @return True if the bounds could be found
+ */
+inline bool getMeshBounds(const string& path, float* bmin, float* bmax) {
+    SourceStamp src, cached;
+    uint32_t nv, nt;
+    if (getFileStamp(path, src) && readMeshCacheHeader(getMeshCachePath(path), cached, nv, nt, bmin, bmax)
+        && cached.size == src.size && cached.mtime == src.mtime) {
+        return true;
+    }
+    ObjMesh mesh;
+    if (!readObj(path, mesh)) {
+        return false;
+    }
+    memcpy(bmin, mesh.bmin, 12);
+    memcpy(bmax, mesh.bmax, 12);
+    return true;
+}
+
+/**
+ * Find the number of triangles in a mesh file without reading all of it:
+ * from the "# number of triangles" line in the comments at the top of
+ * the file (see writeObj), or from the header of its binary cache if
+ * that's up to date, or by reading the mesh if neither is there
+ * @param path Path to the OBJ file
+ * @param numTriangles Filled with the number of triangles
+ * @return True if the count could be found
+ */
+inline bool getMeshTriangleCount(const string& path, size_t& numTriangles) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == NULL) {
+        return false;
+    }
+    char line[256];
+    const char* key = "# number of triangles:";
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), file) != NULL && line[0] == '#') {
+        if (strncmp(line, key, strlen(key)) == 0) {
+            const char* p = line + strlen(key);
+            while (*p == ' ') p++;
+            numTriangles = (size_t)parseInt(p, line + strlen(line));
+            found = true;
+        }
+    }
+    fclose(file);
+    if (found) {
+        return true;
+    }
+    SourceStamp src, cached;
+    uint32_t nv, nt;
+    float lo[3], hi[3];
+    if (getFileStamp(path, src) && readMeshCacheHeader(getMeshCachePath(path), cached, nv, nt, lo, hi)
+        && cached.size == src.size && cached.mtime == src.mtime) {
+        numTriangles = nt;
+        return true;
+    }
+    ObjMesh mesh;
+    if (!readObj(path, mesh)) {
+        return false;
+    }
+    numTriangles = mesh.numTriangles();
+    return true;
+}
+
+#endif
@@ -0,0 +1,230 @@
+/**
+ * This code makes the same triangles for unit boxes, cylinders, cones and
+ * spheres that three.js makes in getUnitGeometry in scenecanvas.js, minus
+ * texture coordinates, so that primitives can be baked into merged
+ * geometry ahead of time
+ */
+#ifndef PRIMITIVEMESH_H
+#define PRIMITIVEMESH_H
+
+#include <vector>
+#include <map>
+#include <array>
+#include <math.h>
+#include <stdint.h>
+#include "ObjMesh.h"
+
+using namespace std;
+
+#ifndef PI
+#define PI 3.14159265
+#endif
+#define PRIMITIVE_SEGMENTS 32 // Must match RADIAL_SEGMENTS in scenecanvas.js
+#define PRIMITIVE_WELD_TOLERANCE 1e-6
+
+/**
+ * Merge vertices that have the same position and normal.  three.js keeps
+ * copies of these along seams and at the centers of caps for the sake of
+ * texture coordinates, which merged geometry doesn't have
+ */
+inline void weldVertices(ObjMesh& mesh) {
+    map<array<long long, 6>, uint32_t> index;
+    vector<uint32_t> slot(mesh.numVertices());
+    ObjMesh welded;
+    for (size_t i = 0; i < slot.size(); i++) {
+        array<long long, 6> key;
+        for (int k = 0; k < 3; k++) {
+            key[k] = llround(mesh.positions[i*3+k]/PRIMITIVE_WELD_TOLERANCE);
+            key[3+k] = llround(mesh.normals[i*3+k]/PRIMITIVE_WELD_TOLERANCE);
+        }
+        map<array<long long, 6>, uint32_t>::iterator it = index.find(key);
+        if (it == index.end()) {
+            it = index.insert(make_pair(key, (uint32_t)welded.numVertices())).first;
+            welded.positions.insert(welded.positions.end(), &mesh.positions[i*3], &mesh.positions[i*3] + 3);
+            welded.normals.insert(welded.normals.end(), &mesh.normals[i*3], &mesh.normals[i*3] + 3);
+        }
+        slot[i] = it->second;
+    }
+    for (size_t i = 0; i < mesh.indices.size(); i++) {
+        welded.indices.push_back(slot[mesh.indices[i]]);
+    }
+    computeBounds(welded);
+    mesh = welded;
+}
+
+/**
+ * Add one side of a box, like buildPlane in three.js's BoxGeometry
+ */
+inline void addBoxSide(ObjMesh& mesh, int u, int v, int w, double udir, double vdir, double depth) {
+    uint32_t first = (uint32_t)mesh.numVertices();
+    for (int iy = 0; iy <= 1; iy++) {
+        for (int ix = 0; ix <= 1; ix++) {
+            float p[3], n[3] = {0, 0, 0};
+            p[u] = (float)((ix - 0.5)*udir);
+            p[v] = (float)((iy - 0.5)*vdir);
+            p[w] = (float)(depth/2);
+            n[w] = depth > 0 ? 1.0f : -1.0f;
+            mesh.positions.insert(mesh.positions.end(), p, p + 3);
+            mesh.normals.insert(mesh.normals.end(), n, n + 3);
+        }
+    }
+    uint32_t a = first, b = first + 2, c = first + 3, d = first + 1;
+    uint32_t tris[6] = {a, b, d, b, c, d};
+    mesh.indices.insert(mesh.indices.end(), tris, tris + 6);
+}
+
+/**
+ * Make a 1x1x1 box centered at the origin
+ */
+inline void makeUnitBox(ObjMesh& mesh) {
+    mesh = ObjMesh();
+    addBoxSide(mesh, 2, 1, 0, -1, -1, 1);
+    addBoxSide(mesh, 2, 1, 0, 1, -1, -1);
+    addBoxSide(mesh, 0, 2, 1, 1, 1, 1);
+    addBoxSide(mesh, 0, 2, 1, 1, -1, -1);
+    addBoxSide(mesh, 0, 1, 2, 1, -1, 1);
+    addBoxSide(mesh, 0, 1, 2, -1, -1, -1);
+    computeBounds(mesh);
+}
+
+/**
+ * Make a cylinder of height 1 centered at the origin along the y axis,
+ * with a bottom radius of 1 and a top radius of either 1 or 0 (a cone).
+ * The degenerate triangles that three.js makes at the tip of a cone
+ * are left out
+ * @param topRadius 1 for a cylinder, 0 for a cone
+ */
+inline void makeUnitCylinder(ObjMesh& mesh, double topRadius) {
+    mesh = ObjMesh();
+    const int n = PRIMITIVE_SEGMENTS;
+    double slope = 1 - topRadius;
+    double nlen = sqrt(1 + slope*slope);
+    for (int y = 0; y <= 1; y++) {
+        double radius = y == 0 ? topRadius : 1;
+        for (int x = 0; x <= n; x++) {
+            double theta = 2*PI*x/n;
+            float p[3] = {(float)(radius*sin(theta)), (float)(0.5 - y), (float)(radius*cos(theta))};
+            float nrm[3] = {(float)(sin(theta)/nlen), (float)(slope/nlen), (float)(cos(theta)/nlen)};
+            mesh.positions.insert(mesh.positions.end(), p, p + 3);
+            mesh.normals.insert(mesh.normals.end(), nrm, nrm + 3);
+        }
+    }
+    for (int x = 0; x < n; x++) {
+        uint32_t a = x, b = n + 1 + x, c = n + 2 + x, d = x + 1;
+        if (topRadius > 0) {
+            uint32_t tri[3] = {a, b, d};
+            mesh.indices.insert(mesh.indices.end(), tri, tri + 3);
+        }
+        uint32_t tri[3] = {b, c, d};
+        mesh.indices.insert(mesh.indices.end(), tri, tri + 3);
+    }
+    for (int top = 1; top >= 0; top--) {
+        if (top && topRadius == 0) {
+            continue;
+        }
+        float sign = top ? 1.0f : -1.0f;
+        uint32_t centers = (uint32_t)mesh.numVertices();
+        for (int x = 0; x < n; x++) {
+            float p[3] = {0, 0.5f*sign, 0};
+            float nrm[3] = {0, sign, 0};
+            mesh.positions.insert(mesh.positions.end(), p, p + 3);
+            mesh.normals.insert(mesh.normals.end(), nrm, nrm + 3);
+        }
+        uint32_t ring = (uint32_t)mesh.numVertices();
+        double radius = top ? topRadius : 1;
+        for (int x = 0; x <= n; x++) {
+            double theta = 2*PI*x/n;
+            float p[3] = {(float)(radius*sin(theta)), 0.5f*sign, (float)(radius*cos(theta))};
+            float nrm[3] = {0, sign, 0};
+            mesh.positions.insert(mesh.positions.end(), p, p + 3);
+            mesh.normals.insert(mesh.normals.end(), nrm, nrm + 3);
+        }
+        for (int x = 0; x < n; x++) {
+            uint32_t c = centers + x, i = ring + x;
+            uint32_t tri[3] = {i, i + 1, c};
+            if (!top) {
+                tri[0] = i + 1;
+                tri[1] = i;
+            }
+            mesh.indices.insert(mesh.indices.end(), tri, tri + 3);
+        }
+    }
+    weldVertices(mesh);
+}
+
+/**
+ * Make a sphere of radius 1 centered at the origin, from rows of
+ * vertices running from the north pole to the south pole
+ */
+inline void makeUnitSphere(ObjMesh& mesh) {
+    mesh = ObjMesh();
+    const int n = PRIMITIVE_SEGMENTS;
+    for (int iy = 0; iy <= n; iy++) {
+        double theta = PI*iy/n;
+        for (int ix = 0; ix <= n; ix++) {
+            double phi = 2*PI*ix/n;
+            float p[3] = {(float)(-cos(phi)*sin(theta)), (float)cos(theta), (float)(sin(phi)*sin(theta))};
+            mesh.positions.insert(mesh.positions.end(), p, p + 3);
+            mesh.normals.insert(mesh.normals.end(), p, p + 3);
+        }
+    }
+    for (int iy = 0; iy < n; iy++) {
+        for (int ix = 0; ix < n; ix++) {
+            uint32_t a = iy*(n+1) + ix + 1, b = iy*(n+1) + ix;
+            uint32_t c = (iy+1)*(n+1) + ix, d = (iy+1)*(n+1) + ix + 1;
+            if (iy != 0) {
+                uint32_t tri[3] = {a, b, d};
+                mesh.indices.insert(mesh.indices.end(), tri, tri + 3);
+            }
+            if (iy != n - 1) {
+                uint32_t tri[3] = {b, c, d};
+                mesh.indices.insert(mesh.indices.end(), tri, tri + 3);
+            }
+        }
+    }
+    weldVertices(mesh);
+}
+
+/**
+ * Append a copy of a mesh to another, scaled along each axis, then
+ * rotated and moved.  Normals are transformed by the inverse transpose so
+ * they stay perpendicular to the surface, and triangles are flipped if
+ * the scale mirrors the mesh
+ * @param out Mesh to append to
+ * @param mesh Mesh to copy
+ * @param t The position (3), rotation matrix (9, row major) and scale (3)
+ */
+inline void appendTransformed(ObjMesh& out, const ObjMesh& mesh, const double* t) {
+    const double* c = t;
+    const double* R = t + 3;
+    const double* s = t + 12;
+    // Cofactors of the scale, which are the inverse scale times its
+    // determinant, so normalizing them only leaves the determinant's sign
+    bool mirrored = s[0]*s[1]*s[2] < 0;
+    double sign = mirrored ? -1 : 1;
+    double ns[3] = {sign*s[1]*s[2], sign*s[0]*s[2], sign*s[0]*s[1]};
+    uint32_t first = (uint32_t)out.numVertices();
+    size_t nv = mesh.numVertices();
+    for (size_t i = 0; i < nv; i++) {
+        const float* p = &mesh.positions[i*3];
+        const float* n = &mesh.normals[i*3];
+        double sp[3] = {p[0]*s[0], p[1]*s[1], p[2]*s[2]};
+        double sn[3] = {n[0]*ns[0], n[1]*ns[1], n[2]*ns[2]};
+        double wn[3];
+        for (int k = 0; k < 3; k++) {
+            out.positions.push_back((float)(c[k] + R[k*3]*sp[0] + R[k*3+1]*sp[1] + R[k*3+2]*sp[2]));
+            wn[k] = R[k*3]*sn[0] + R[k*3+1]*sn[1] + R[k*3+2]*sn[2];
+        }
+        double len = sqrt(wn[0]*wn[0] + wn[1]*wn[1] + wn[2]*wn[2]);
+        for (int k = 0; k < 3; k++) {
+            out.normals.push_back(len > 0 ? (float)(wn[k]/len) : 0.0f);
+        }
+    }
+    for (size_t i = 0; i < mesh.indices.size(); i += 3) {
+        out.indices.push_back(first + mesh.indices[i]);
+        out.indices.push_back(first + mesh.indices[mirrored ? i+2 : i+1]);
+        out.indices.push_back(first + mesh.indices[mirrored ? i+1 : i+2]);
+    }
+}
+
+#endif
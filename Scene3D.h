@@ -7,12 +7,44 @@
 
 #include <vector>
 #include <map>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <chrono>
 #include <fstream>
 #include <string>
 #include <sstream>
 #include <iostream>
 #include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#else
+#include <dirent.h>
+#endif
+#include "ObjMesh.h"
+#include "MeshSimplify.h"
+#include "PrimitiveMesh.h"
+#include "SpatialIndex.h"
+#include "SceneWriter.h"
+#include "Visibility.h"
 #define PI 3.14159265
+#define NO_PATH 0xFFFFFFFF
+#define BINARY_VERSION 1
+#define MERGED_VERSION 1
+#define STREAM_BLOCK_OBJECTS 65536
+#define BINARY_CONSTANT 0
+#define BINARY_INT8 1
+#define BINARY_INT16 2
+#define BINARY_INT32 3
+#define BINARY_FLOAT32 4
 
 using namespace std;
 
@@ -20,13 +52,1910 @@ using namespace std;
 
 #define HTML_END "<table cellpadding>\n    <tr>\n        <td>\n            <h3>Controls</h3>\n            <ul>\n                <li><b>Mouse</b>: Click and drag to look around</li>\n                <li><b>W:</b> Forward</li>\n                <li><b>S:</b> Backwards</li>\n                <li><b>A:</b> Left</li>\n                <li><b>D:</b> Right</li>\n                <li><b>E:</b> Up</li>\n                <li><b>C:</b> Down</li>\n            </ul>\n        </td>\n    </tr>\n</table>\n    </body>\n</html>";
 
+/**
+ * The different kinds of objects that can be placed in a scene
+ */
+enum ObjectKind {
+    KIND_BOX,
+    KIND_CYLINDER,
+    KIND_CONE,
+    KIND_ELLIPSOID,
+    KIND_MESH,
+    KIND_TEXTURED_MESH,
+    NUM_OBJECT_KINDS
+};
+
+/**
+ * The parameters of a MeshStandardMaterial, in the same order as
+ * getMaterialPrefix in scenecanvas.js
+ */
+struct Material {
+    double r, g, b;
+    double roughness, metalness;
+
+    bool operator<(const Material& other) const {
+        if (r != other.r) return r < other.r;
+        if (g != other.g) return g < other.g;
+        if (b != other.b) return b < other.b;
+        if (roughness != other.roughness) return roughness < other.roughness;
+        return metalness < other.metalness;
+    }
+};
+
+/**
+ * All primitives of one kind, stored as a structure of arrays.  Vector
+ * quantities are packed 3 doubles per object
+ */
+struct PrimitiveArray {
+    vector<double> center; // (cx, cy, cz)
+    vector<double> dims; // Box (xlen, ylen, zlen), cylinder/cone (radius, height, 0), ellipsoid (radx, rady, radz)
+    vector<double> rot; // (rx, ry, rz) in degrees
+    vector<double> scale; // (sx, sy, sz), only for cylinders and cones
+    vector<uint32_t> material; // Index into the scene's material table
+
+    size_t size() const {
+        return material.size();
+    }
+
+    void clear() {
+        center.clear();
+        dims.clear();
+        rot.clear();
+        scale.clear();
+        material.clear();
+    }
+};
+
+/**
+ * All placements of meshes of one kind, stored as a structure of arrays
+ */
+struct MeshArray {
+    vector<uint32_t> path; // Index into the scene's path table
+    vector<uint32_t> matpath; // Index into the scene's path table (textured meshes only)
+    vector<double> center; // (cx, cy, cz)
+    vector<double> rot; // (rx, ry, rz) in degrees
+    vector<double> scale; // (sx, sy, sz)
+    vector<uint32_t> material; // Index into the scene's material table (plain meshes only)
+    vector<double> shininess; // Textured meshes only
+
+    size_t size() const {
+        return path.size();
+    }
+
+    void clear() {
+        path.clear();
+        matpath.clear();
+        center.clear();
+        rot.clear();
+        scale.clear();
+        material.clear();
+        shininess.clear();
+    }
+};
+
+/**
+ * Ways that saveScene can write the objects in a scene
+ */
+enum OutputMode {
+    OUTPUT_JS,
+    OUTPUT_BINARY_EMBEDDED,
+    OUTPUT_BINARY_SIDECAR,
+    OUTPUT_BINARY_CHUNKED
+};
+
+/**
+ * Identifies an object in a scene by its kind and the order in which
+ * it was added among objects of that kind
+ */
+struct ObjectRef {
+    ObjectKind kind;
+    uint32_t index;
+};
+
+struct Camera {
+    double x, y, z;
+    double rot;
+};
+
+struct Light {
+    bool directional;
+    double x, y, z;
+    double r, g, b;
+    double intensity;
+};
+
+/**
+ * What the bytes of a saved scene are spent on, for SceneStats
+ */
+enum StatsCategory {
+    BYTES_PAGE, // HTML and script boilerplate
+    BYTES_LIGHTS,
+    BYTES_CAMERAS,
+    BYTES_MATERIALS, // Material replacements in the pages of SceneVariants
+    BYTES_MESH_ASSETS, // Mesh asset tables and levels of detail
+    BYTES_PRIMITIVES, // JavaScript calls that add primitives
+    BYTES_MESHES, // JavaScript calls that add plain meshes
+    BYTES_TEXTURED_MESHES,
+    BYTES_BINARY_SCENE, // Binary scenes, embedded or in sidecar files
+    BYTES_MERGED, // Merged primitives, embedded or in sidecar files
+    BYTES_CHUNKS, // Chunk files, their manifest, and whatever is always drawn
+    BYTES_VISIBILITY,
+    NUM_BYTE_CATEGORIES
+};
+
+/**
+ * The parts of building and saving a scene that SceneStats times
+ */
+enum StatsPhase {
+    PHASE_BUILD, // From when the scene was made, or last saved, until it was saved, less the time spent saving
+    PHASE_MERGE, // Merging in other scenes
+    PHASE_MESH_ASSETS, // Finding mesh assets and bringing their caches up to date
+    PHASE_MESH_LODS,
+    PHASE_MERGE_PRIMITIVES,
+    PHASE_OBJECTS, // Writing or packing primitives and meshes
+    PHASE_VISIBILITY,
+    PHASE_SAVE, // All of saving, including the save phases above
+    NUM_PHASES
+};
+
+/**
+ * What a scene will cost the viewer, and what it cost to build and save
+ * (see Scene3D::getStats)
+ */
+struct SceneStats {
+    size_t objects[NUM_OBJECT_KINDS];
+    size_t lights;
+    size_t cameras;
+    size_t materials; // Unique materials, one for each key of getMaterialPrefix in scenecanvas.js
+    size_t meshPaths; // Unique mesh files that are placed
+    double triangles; // Triangles in every object at full detail
+    double drawCalls; // Draw calls with every object in view and every chunk loaded
+    double bytes[NUM_BYTE_CATEGORIES];
+    double seconds[NUM_PHASES];
+};
+
+/**
+ * Adds the wall time from when it's made until it goes out of scope to
+ * a running total
+ */
+struct PhaseTimer {
+    double& seconds;
+    chrono::steady_clock::time_point start;
+
+    PhaseTimer(double& seconds): seconds(seconds), start(chrono::steady_clock::now()) {}
+
+    ~PhaseTimer() {
+        seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+};
+
+class SceneVariant;
+
 class Scene3D {
+    friend class SceneVariant;
+
     private:
-        stringstream sceneCode;
+        PrimitiveArray prims[KIND_ELLIPSOID+1];
+        MeshArray meshes[2]; // Plain meshes, then textured meshes
+        vector<Camera> cameras;
+        vector<Light> lights;
+
+        vector<Material> materials;
+        map<Material, uint32_t> materialIndex;
+        vector<string> paths;
+        map<string, uint32_t> pathIndex;
+
+        bool instancing;
+        bool meshCache;
+        bool meshLods;
+        bool mergePrimitives;
+        bool visibilityCulling;
+        OutputMode outputMode;
+        double chunkSize;
+        double chunkLoadRadius;
+
+        bool indexed;
+        bool rejectOverlaps;
+        SpatialIndex spatialIndex;
+        vector<ObjectRef> indexRefs; // Which object each box in the spatial index belongs to
+        vector<AABB> meshBounds; // Local bounding box of each mesh path, once looked up
+        vector<bool> meshBoundsKnown;
+        mutable vector<uint32_t> queryIds; // Scratch space for spatial queries
+
+        vector<pair<uint32_t, uint32_t> > meshAssets; // Mesh assets written so far by saveScene or streaming
+        map<pair<uint32_t, uint32_t>, uint32_t> meshAssetIndex;
+        shared_ptr<SceneWriter> stream; // Only set while streaming (see beginStreaming)
+        string streamFilename;
+        string streamName;
+        size_t numStreamed[NUM_OBJECT_KINDS]; // Objects of each kind already written out by streaming
+        size_t numStreamedLights;
+        size_t numStreamedCameras;
+
+        SceneStats stats; // Only the draw calls, bytes and times are kept here (see getStats)
+        vector<size_t> meshUses; // Number of placements of each path as a mesh
+        vector<double> meshTriangles; // Triangles in each mesh path, or -1 until looked up
+        chrono::steady_clock::time_point lastSaved; // When the scene was made or last saved
+        double mergeSeconds; // Time spent merging since then
+        bool statsReport;
+        double maxDrawCalls;
+        double maxTriangles;
+
+        /**
+         * Return the index of a material in the material table, adding
+         * it if this is the first time it has been seen
+         */
+        uint32_t internMaterial(double r, double g, double b, double roughness, double metalness) {
+            Material m = {r, g, b, roughness, metalness};
+            map<Material, uint32_t>::iterator it = materialIndex.find(m);
+            if (it != materialIndex.end()) {
+                return it->second;
+            }
+            uint32_t idx = (uint32_t)materials.size();
+            materials.push_back(m);
+            materialIndex[m] = idx;
+            return idx;
+        }
+
+        /**
+         * Return the index of a file path in the path table, adding it
+         * if this is the first time it has been seen
+         */
+        uint32_t internPath(const string& path) {
+            map<string, uint32_t>::iterator it = pathIndex.find(path);
+            if (it != pathIndex.end()) {
+                return it->second;
+            }
+            uint32_t idx = (uint32_t)paths.size();
+            paths.push_back(path);
+            pathIndex[path] = idx;
+            meshUses.push_back(0);
+            return idx;
+        }
+
+        static void push3(vector<double>& v, double x, double y, double z) {
+            v.push_back(x);
+            v.push_back(y);
+            v.push_back(z);
+        }
+
+        void addPrimitive(ObjectKind kind, double cx, double cy, double cz,
+                            double d1, double d2, double d3,
+                            double r, double g, double b,
+                            double roughness, double metalness,
+                            double rx, double ry, double rz) {
+            PrimitiveArray& a = prims[kind];
+            push3(a.center, cx, cy, cz);
+            push3(a.dims, d1, d2, d3);
+            push3(a.rot, rx, ry, rz);
+            a.material.push_back(internMaterial(r, g, b, roughness, metalness));
+        }
+
+        /**
+         * Compute the rotation matrix of the quaternion that
+         * glMatrix.quat.fromEuler(q, rx, ry, rz) makes in scenecanvas.js
+         */
+        static void eulerToMatrix(double rx, double ry, double rz, double R[3][3]) {
+            double h = 0.5*PI/180;
+            double sx = sin(rx*h), cx = cos(rx*h);
+            double sy = sin(ry*h), cy = cos(ry*h);
+            double sz = sin(rz*h), cz = cos(rz*h);
+            double x = sx*cy*cz - cx*sy*sz;
+            double y = cx*sy*cz + sx*cy*sz;
+            double z = cx*cy*sz - sx*sy*cz;
+            double w = cx*cy*cz + sx*sy*sz;
+            R[0][0] = 1 - 2*(y*y + z*z); R[0][1] = 2*(x*y - z*w);     R[0][2] = 2*(x*z + y*w);
+            R[1][0] = 2*(x*y + z*w);     R[1][1] = 1 - 2*(x*x + z*z); R[1][2] = 2*(y*z - x*w);
+            R[2][0] = 2*(x*z - y*w);     R[2][1] = 2*(y*z + x*w);     R[2][2] = 1 - 2*(x*x + y*y);
+        }
+
+        /**
+         * Look up the bounding box of a mesh file in its own coordinates.
+         * Meshes that can't be read are treated as a single point
+         */
+        const AABB& getLocalMeshBounds(uint32_t path) {
+            if (meshBounds.size() < paths.size()) {
+                meshBounds.resize(paths.size());
+                meshBoundsKnown.resize(paths.size(), false);
+            }
+            if (!meshBoundsKnown[path]) {
+                float lo[3] = {0, 0, 0}, hi[3] = {0, 0, 0};
+                if (!getMeshBounds(paths[path], lo, hi)) {
+                    cerr << "Warning: Could not read bounds of " << paths[path] << endl;
+                }
+                for (int k = 0; k < 3; k++) {
+                    meshBounds[path].min[k] = lo[k];
+                    meshBounds[path].max[k] = hi[k];
+                }
+                meshBoundsKnown[path] = true;
+            }
+            return meshBounds[path];
+        }
+
+        /**
+         * Look up the number of triangles in a mesh file.  Meshes that
+         * can't be read count as none
+         */
+        double getMeshTriangles(uint32_t path) {
+            if (meshTriangles.size() < paths.size()) {
+                meshTriangles.resize(paths.size(), -1);
+            }
+            if (meshTriangles[path] < 0) {
+                size_t n = 0;
+                if (!getMeshTriangleCount(paths[path], n)) {
+                    cerr << "Warning: Could not count the triangles of " << paths[path] << endl;
+                }
+                meshTriangles[path] = (double)n;
+            }
+            return meshTriangles[path];
+        }
+
+        /**
+         * Return the number of triangles in the unit geometry that the
+         * viewer draws for a kind of primitive
+         */
+        static size_t getUnitTriangles(int kind) {
+            static const vector<size_t> counts = []() {
+                ObjMesh unit[KIND_ELLIPSOID+1];
+                makeUnitBox(unit[KIND_BOX]);
+                makeUnitCylinder(unit[KIND_CYLINDER], 1);
+                makeUnitCylinder(unit[KIND_CONE], 0);
+                makeUnitSphere(unit[KIND_ELLIPSOID]);
+                vector<size_t> n;
+                for (int k = KIND_BOX; k <= KIND_ELLIPSOID; k++) {
+                    n.push_back(unit[k].numTriangles());
+                }
+                return n;
+            }();
+            return counts[kind];
+        }
+
+        /**
+         * Compute the world bounding box of an object from the bounding box
+         * of its geometry, its scale, its rotation and its position
+         */
+        void computeBounds(ObjectKind kind, size_t i, AABB& box) {
+            double c[3] = {0, 0, 0}; // Center of the geometry's own box
+            double e[3]; // Half extents of the geometry's own box, after scaling
+            const vector<double>* center;
+            const vector<double>* rot;
+            if (kind <= KIND_ELLIPSOID) {
+                const PrimitiveArray& a = prims[kind];
+                center = &a.center;
+                rot = &a.rot;
+                const double* d = &a.dims[i*3];
+                if (kind == KIND_BOX) {
+                    e[0] = d[0]/2; e[1] = d[1]/2; e[2] = d[2]/2;
+                }
+                else if (kind == KIND_ELLIPSOID) {
+                    e[0] = d[0]; e[1] = d[1]; e[2] = d[2];
+                }
+                else {
+                    const double* s = &a.scale[i*3];
+                    e[0] = d[0]*s[0]; e[1] = d[1]/2*s[1]; e[2] = d[0]*s[2];
+                }
+            }
+            else {
+                const MeshArray& m = meshes[kind - KIND_MESH];
+                center = &m.center;
+                rot = &m.rot;
+                const AABB& local = getLocalMeshBounds(m.path[i]);
+                for (int k = 0; k < 3; k++) {
+                    double s = m.scale[i*3+k];
+                    c[k] = s*(local.min[k] + local.max[k])/2;
+                    e[k] = s*(local.max[k] - local.min[k])/2;
+                }
+            }
+            const double* r = &(*rot)[i*3];
+            double R[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+            if (r[0] != 0 || r[1] != 0 || r[2] != 0) {
+                eulerToMatrix(r[0], r[1], r[2], R);
+            }
+            for (int k = 0; k < 3; k++) {
+                double wc = (*center)[i*3+k];
+                double we = 0;
+                for (int j = 0; j < 3; j++) {
+                    wc += R[k][j]*c[j];
+                    we += fabs(R[k][j]*e[j]);
+                }
+                box.min[k] = wc - we;
+                box.max[k] = wc + we;
+            }
+        }
+
+        /**
+         * Return the number of objects of a particular kind that are held in
+         * memory, which is all of them unless the scene is streaming
+         */
+        size_t getNumBuffered(ObjectKind kind) const {
+            if (kind <= KIND_ELLIPSOID) {
+                return prims[kind].size();
+            }
+            return meshes[kind - KIND_MESH].size();
+        }
+
+        /**
+         * Remove the object that was added last of a particular kind
+         */
+        void popObject(ObjectKind kind) {
+            if (kind <= KIND_ELLIPSOID) {
+                PrimitiveArray& a = prims[kind];
+                a.center.resize(a.center.size() - 3);
+                a.dims.resize(a.dims.size() - 3);
+                a.rot.resize(a.rot.size() - 3);
+                if (a.scale.size() > 0) {
+                    a.scale.resize(a.scale.size() - 3);
+                }
+                a.material.pop_back();
+            }
+            else {
+                MeshArray& m = meshes[kind - KIND_MESH];
+                meshUses[m.path.back()]--;
+                m.path.pop_back();
+                m.center.resize(m.center.size() - 3);
+                m.rot.resize(m.rot.size() - 3);
+                m.scale.resize(m.scale.size() - 3);
+                if (kind == KIND_MESH) {
+                    m.material.pop_back();
+                }
+                else {
+                    m.matpath.pop_back();
+                    m.shininess.pop_back();
+                }
+            }
+        }
+
+        /**
+         * Add the object that was just added to the spatial index, if
+         * there is one, or take it back out of the scene if it overlaps
+         * another object and overlaps are being rejected.  When streaming,
+         * this is also where full blocks get written out
+         * @return True if the object was kept
+         */
+        bool placeObject(ObjectKind kind) {
+            if (indexed) {
+                size_t i = getNumBuffered(kind) - 1;
+                AABB box;
+                computeBounds(kind, i, box);
+                if (rejectOverlaps && spatialIndex.overlapsAny(box)) {
+                    popObject(kind);
+                    return false;
+                }
+                spatialIndex.insert(box);
+                ObjectRef ref = {kind, (uint32_t)(numStreamed[kind] + i)};
+                indexRefs.push_back(ref);
+            }
+            if (stream) {
+                streamIfFull();
+            }
+            return true;
+        }
+
+        /**
+         * Add every object from a particular index onwards of each kind to
+         * the spatial index
+         */
+        void indexObjects(const size_t* firstOfKind) {
+            for (int kind = KIND_BOX; kind < NUM_OBJECT_KINDS; kind++) {
+                size_t n = getNumBuffered((ObjectKind)kind);
+                for (size_t i = firstOfKind[kind]; i < n; i++) {
+                    AABB box;
+                    computeBounds((ObjectKind)kind, i, box);
+                    spatialIndex.insert(box);
+                    ObjectRef ref = {(ObjectKind)kind, (uint32_t)(numStreamed[kind] + i)};
+                    indexRefs.push_back(ref);
+                }
+            }
+        }
+
+        static void writeTriple(SceneWriter& out, const vector<double>& v, size_t i) {
+            out << v[i*3] << "," << v[i*3+1] << "," << v[i*3+2];
+        }
+
+        void writeMaterial(SceneWriter& out, uint32_t idx) const {
+            const Material& m = materials[idx];
+            out << m.r << "," << m.g << "," << m.b << "," << m.roughness << "," << m.metalness;
+        }
+
+        /**
+         * Write the JavaScript call that adds a single primitive
+         */
+        void writePrimitive(SceneWriter& out, int kind, size_t i) const {
+            const char* names[] = {"canvas.addBox(", "canvas.addCylinder(", "canvas.addCone(", "canvas.addEllipsoid("};
+            const PrimitiveArray& a = prims[kind];
+            out << names[kind];
+            writeTriple(out, a.center, i);
+            out << "," << a.dims[i*3] << "," << a.dims[i*3+1];
+            if (kind == KIND_BOX || kind == KIND_ELLIPSOID) {
+                out << "," << a.dims[i*3+2];
+            }
+            out << ",";
+            writeMaterial(out, a.material[i]);
+            out << ",";
+            writeTriple(out, a.rot, i);
+            if (a.scale.size() > 0) {
+                out << ",";
+                writeTriple(out, a.scale, i);
+            }
+            out << ");\n";
+        }
+
+        /**
+         * Find the unique mesh assets used by the scene, and add the ones
+         * that haven't been written yet to meshAssets as (path, matpath)
+         * indices, where matpath is NO_PATH for plain meshes.  Plain meshes
+         * are keyed by path and textured meshes by (path, material path)
+         * @param assetOf Filled with the asset index of every plain mesh
+         *                placement, then every textured mesh placement
+         */
+        void findMeshAssets(vector<uint32_t> assetOf[2]) {
+            vector<pair<uint32_t, uint32_t> >& assets = meshAssets;
+            map<pair<uint32_t, uint32_t>, uint32_t>& index = meshAssetIndex;
+            for (int textured = 0; textured < 2; textured++) {
+                const MeshArray& m = meshes[textured];
+                assetOf[textured].resize(m.size());
+                for (size_t i = 0; i < m.size(); i++) {
+                    pair<uint32_t, uint32_t> key(m.path[i], textured ? m.matpath[i] : NO_PATH);
+                    map<pair<uint32_t, uint32_t>, uint32_t>::iterator it = index.find(key);
+                    if (it == index.end()) {
+                        it = index.insert(make_pair(key, (uint32_t)assets.size())).first;
+                        assets.push_back(key);
+                    }
+                    assetOf[textured][i] = it->second;
+                }
+            }
+        }
+
+        /**
+         * Write the JavaScript that declares the mesh asset table
+         * @param first Index of the first asset that hasn't been written yet
+         */
+        void writeMeshAssets(SceneWriter& out, const vector<pair<uint32_t, uint32_t> >& assets, size_t first) const {
+            for (size_t i = first; i < assets.size(); i++) {
+                const string& path = paths[assets[i].first];
+                if (assets[i].second == NO_PATH && meshCache && updateMeshCache(path)) {
+                    out << "canvas.addBinaryMeshAsset(\"" << getMeshCachePath(path) << "\");\n";
+                }
+                else if (assets[i].second == NO_PATH) {
+                    out << "canvas.addMeshAsset(\"" << paths[assets[i].first] << "\");\n";
+                }
+                else {
+                    out << "canvas.addTexturedMeshAsset(\"" << paths[assets[i].first] << "\",\"" << paths[assets[i].second] << "\");\n";
+                }
+            }
+        }
+
+        /**
+         * Bring the levels of detail of the plain mesh assets up to date, in
+         * parallel, and write the JavaScript that tells the viewer about them.
+         * Level k is used from MESH_LOD_DISTANCE*2^(k-1) bounding radii away
+         * @param first Index of the first asset that hasn't been written yet
+         */
+        void writeMeshLods(SceneWriter& out, const vector<pair<uint32_t, uint32_t> >& assets, size_t first) const {
+            vector<string> objPaths;
+            vector<size_t> which;
+            for (size_t i = first; i < assets.size(); i++) {
+                if (assets[i].second == NO_PATH) {
+                    objPaths.push_back(paths[assets[i].first]);
+                    which.push_back(i);
+                }
+            }
+            vector<vector<string> > lodPaths;
+            vector<double> radii;
+            updateMeshLods(objPaths, lodPaths, radii);
+            for (size_t i = 0; i < objPaths.size(); i++) {
+                if (lodPaths[i].size() == 0) {
+                    continue;
+                }
+                out << "canvas.setMeshAssetLods(" << which[i] << ",[";
+                for (size_t k = 0; k < lodPaths[i].size(); k++) {
+                    out << (k == 0 ? "" : ",") << "\"" << lodPaths[i][k] << "\"";
+                }
+                out << "],[";
+                for (size_t k = 0; k < lodPaths[i].size(); k++) {
+                    out << (k == 0 ? "" : ",") << MESH_LOD_DISTANCE*radii[i]*pow(2.0, (double)k);
+                }
+                out << "]);\n";
+            }
+        }
+
+        /**
+         * Write the JavaScript call that places a single plain mesh
+         */
+        void writeMesh(SceneWriter& out, size_t i, uint32_t asset) const {
+            const MeshArray& m = meshes[0];
+            out << "canvas.addMeshRef(" << asset << ",";
+            writeTriple(out, m.center, i);
+            out << ",";
+            writeTriple(out, m.rot, i);
+            out << ",";
+            writeTriple(out, m.scale, i);
+            out << ",";
+            writeMaterial(out, m.material[i]);
+            out << ");\n";
+        }
+
+        /**
+         * Compute the translation, rotation and scale that take the unit
+         * geometry of an object's kind (see getUnitGeometry in scenecanvas.js)
+         * to the object itself
+         * @param kind The kind of object
+         * @param i Index of the object within its kind
+         * @param t 9 element array to fill with (cx, cy, cz, rx, ry, rz, sx, sy, sz)
+         */
+        void getInstanceTransform(int kind, size_t i, double* t) const {
+            const vector<double>* center;
+            const vector<double>* rot;
+            double s[3] = {1, 1, 1};
+            if (kind <= KIND_ELLIPSOID) {
+                const PrimitiveArray& a = prims[kind];
+                center = &a.center;
+                rot = &a.rot;
+                if (kind == KIND_CYLINDER || kind == KIND_CONE) {
+                    // Unit cylinders/cones have radius 1 and height 1
+                    s[0] = a.dims[i*3]*a.scale[i*3];
+                    s[1] = a.dims[i*3+1]*a.scale[i*3+1];
+                    s[2] = a.dims[i*3]*a.scale[i*3+2];
+                }
+                else {
+                    for (int k = 0; k < 3; k++) {
+                        s[k] = a.dims[i*3+k];
+                    }
+                }
+            }
+            else {
+                const MeshArray& m = meshes[kind - KIND_MESH];
+                center = &m.center;
+                rot = &m.rot;
+                for (int k = 0; k < 3; k++) {
+                    s[k] = m.scale[i*3+k];
+                }
+            }
+            for (int k = 0; k < 3; k++) {
+                t[k] = (*center)[i*3+k];
+                t[3+k] = (*rot)[i*3+k];
+                t[6+k] = s[k];
+            }
+        }
+
+        /**
+         * Group the objects of one kind into batches that can be drawn
+         * together.  Objects are stably sorted so that those sharing the
+         * same keys are contiguous, keeping their relative order
+         * @param key1 First key of each object (e.g. path index), or NULL
+         * @param key2 Second key of each object (e.g. material index)
+         * @param order Filled with object indices in batch order
+         * @param starts Filled with the start of each batch in order,
+         *               followed by order.size()
+         */
+        static void makeBatches(const vector<uint32_t>* key1, const vector<uint32_t>& key2,
+                                vector<uint32_t>& order, vector<size_t>& starts,
+                                const vector<uint32_t>* subset = NULL) {
+            size_t n = subset == NULL ? key2.size() : subset->size();
+            vector<uint64_t> keys(n);
+            for (size_t i = 0; i < n; i++) {
+                size_t idx = subset == NULL ? i : (*subset)[i];
+                uint64_t k1 = key1 == NULL ? 0 : (*key1)[idx];
+                keys[i] = (k1 << 32) | key2[idx];
+            }
+            order.resize(n);
+            for (size_t i = 0; i < n; i++) {
+                order[i] = (uint32_t)i;
+            }
+            BatchKeyLess less = {&keys};
+            stable_sort(order.begin(), order.end(), less);
+            starts.clear();
+            for (size_t i = 0; i < n; i++) {
+                if (i == 0 || keys[order[i]] != keys[order[i-1]]) {
+                    starts.push_back(i);
+                }
+            }
+            starts.push_back(n);
+            if (subset != NULL) {
+                for (size_t i = 0; i < n; i++) {
+                    order[i] = (*subset)[order[i]];
+                }
+            }
+        }
+
+        struct BatchKeyLess {
+            const vector<uint64_t>* keys;
+            bool operator()(uint32_t a, uint32_t b) const {
+                return (*keys)[a] < (*keys)[b];
+            }
+        };
+
+        /**
+         * Group the objects of one kind into batches that share a material
+         * and, for plain meshes, a mesh asset.  If subset is given, only
+         * the objects at those indices (in increasing order) are grouped
+         */
+        void getBatches(int kind, const vector<uint32_t>& meshAssetOf,
+                        vector<uint32_t>& order, vector<size_t>& starts,
+                        const vector<uint32_t>* subset = NULL) const {
+            if (kind == KIND_MESH) {
+                makeBatches(&meshAssetOf, meshes[0].material, order, starts, subset);
+            }
+            else {
+                makeBatches(NULL, prims[kind].material, order, starts, subset);
+            }
+        }
+
+        static void appendU32(string& buf, uint32_t x) {
+            buf.append((const char*)&x, 4);
+        }
+
+        static void appendF64(string& buf, double x) {
+            buf.append((const char*)&x, 8);
+        }
+
+        static void pad4(string& buf) {
+            while (buf.size() % 4 != 0) {
+                buf.push_back(0);
+            }
+        }
+
+        /**
+         * Append one transform component of a batch to a binary payload,
+         * using the smallest encoding that represents every value exactly:
+         * a single float64 constant, or int8/int16/int32 multiples of a power
+         * of ten.  Anything else is stored as float32.  Each column starts
+         * with a 4 byte header (type, decimals, 2 bytes padding)
+         */
+        static void packColumn(string& buf, const vector<double>& values) {
+            bool constant = true;
+            for (size_t i = 1; i < values.size() && constant; i++) {
+                constant = values[i] == values[0];
+            }
+            if (constant) {
+                buf.push_back(BINARY_CONSTANT);
+                buf.append(3, 0);
+                appendF64(buf, values[0]);
+                return;
+            }
+            for (int decimals = 0; decimals <= 4; decimals++) {
+                double p = pow(10.0, decimals);
+                double qmax = 0;
+                bool exact = true;
+                for (size_t i = 0; i < values.size() && exact; i++) {
+                    double q = floor(values[i]*p + 0.5);
+                    exact = fabs(q/p - values[i]) <= 1e-9*max(1.0, fabs(values[i])) && fabs(q) < 2147483647.0;
+                    qmax = max(qmax, fabs(q));
+                }
+                if (!exact) {
+                    continue;
+                }
+                int type = qmax < 128 ? BINARY_INT8 : (qmax < 32768 ? BINARY_INT16 : BINARY_INT32);
+                buf.push_back((char)type);
+                buf.push_back((char)decimals);
+                buf.append(2, 0);
+                for (size_t i = 0; i < values.size(); i++) {
+                    int32_t q = (int32_t)floor(values[i]*p + 0.5);
+                    if (type == BINARY_INT8) {
+                        int8_t x = (int8_t)q;
+                        buf.append((const char*)&x, 1);
+                    }
+                    else if (type == BINARY_INT16) {
+                        int16_t x = (int16_t)q;
+                        buf.append((const char*)&x, 2);
+                    }
+                    else {
+                        buf.append((const char*)&q, 4);
+                    }
+                }
+                pad4(buf);
+                return;
+            }
+            buf.push_back(BINARY_FLOAT32);
+            buf.append(3, 0);
+            for (size_t i = 0; i < values.size(); i++) {
+                float x = (float)values[i];
+                buf.append((const char*)&x, 4);
+            }
+        }
+
+        /**
+         * Pack every primitive and plain mesh into a binary payload that
+         * canvas.loadBinaryScene decodes.  The layout, all little endian, is
+         * 
+         * "S3DB", uint32 version, uint32 numMaterials, uint32 numBatches
+         * numMaterials x float64 (r, g, b, roughness, metalness)
+         * numBatches x (uint32 kind, uint32 mesh asset, uint32 material,
+         *               uint32 count, 9 columns from packColumn holding
+         *               x, y, z, rx, ry, rz, sx, sy, sz of each instance)
+         *
+         * If subsets is given, it holds one list of object indices for each
+         * kind from KIND_BOX to KIND_MESH, and only those objects are packed
+         * @return The number of batches, each of which is one draw call
+         */
+        size_t packBinaryScene(string& buf, const vector<uint32_t>& meshAssetOf,
+                             const vector<uint32_t>* subsets = NULL) const {
+            // Only the materials that are used are stored, in table order
+            vector<uint32_t> used;
+            vector<uint32_t> slot(materials.size(), 0);
+            if (subsets == NULL) {
+                for (size_t i = 0; i < materials.size(); i++) {
+                    used.push_back((uint32_t)i);
+                    slot[i] = (uint32_t)i;
+                }
+            }
+            else {
+                vector<bool> isUsed(materials.size(), false);
+                for (int kind = KIND_BOX; kind <= KIND_MESH; kind++) {
+                    const vector<uint32_t>& material = kind == KIND_MESH ? meshes[0].material : prims[kind].material;
+                    for (size_t j = 0; j < subsets[kind].size(); j++) {
+                        isUsed[material[subsets[kind][j]]] = true;
+                    }
+                }
+                for (size_t i = 0; i < materials.size(); i++) {
+                    if (isUsed[i]) {
+                        slot[i] = (uint32_t)used.size();
+                        used.push_back((uint32_t)i);
+                    }
+                }
+            }
+            buf.append("S3DB", 4);
+            appendU32(buf, BINARY_VERSION);
+            appendU32(buf, (uint32_t)used.size());
+            size_t numBatchesPos = buf.size();
+            appendU32(buf, 0);
+            for (size_t i = 0; i < used.size(); i++) {
+                const Material& m = materials[used[i]];
+                appendF64(buf, m.r);
+                appendF64(buf, m.g);
+                appendF64(buf, m.b);
+                appendF64(buf, m.roughness);
+                appendF64(buf, m.metalness);
+            }
+            uint32_t numBatches = 0;
+            vector<uint32_t> order;
+            vector<size_t> starts;
+            vector<double> columns[9];
+            double t[9];
+            for (int kind = KIND_BOX; kind <= KIND_MESH; kind++) {
+                getBatches(kind, meshAssetOf, order, starts, subsets == NULL ? NULL : &subsets[kind]);
+                const vector<uint32_t>& material = kind == KIND_MESH ? meshes[0].material : prims[kind].material;
+                for (size_t b = 0; b+1 < starts.size(); b++) {
+                    size_t first = starts[b];
+                    size_t n = starts[b+1] - first;
+                    appendU32(buf, (uint32_t)kind);
+                    appendU32(buf, kind == KIND_MESH ? meshAssetOf[order[first]] : 0);
+                    appendU32(buf, slot[material[order[first]]]);
+                    appendU32(buf, (uint32_t)n);
+                    for (int k = 0; k < 9; k++) {
+                        columns[k].resize(n);
+                    }
+                    for (size_t j = 0; j < n; j++) {
+                        getInstanceTransform(kind, order[first+j], t);
+                        for (int k = 0; k < 9; k++) {
+                            columns[k][j] = t[k];
+                        }
+                    }
+                    for (int k = 0; k < 9; k++) {
+                        packColumn(buf, columns[k]);
+                    }
+                    numBatches++;
+                }
+            }
+            memcpy(&buf[numBatchesPos], &numBatches, 4);
+            return numBatches;
+        }
+
+        /**
+         * Encode a block of bytes as base64
+         */
+        static string base64(const string& data) {
+            static const char* chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+            string out;
+            out.reserve((data.size() + 2)/3*4);
+            size_t i = 0;
+            for (; i + 2 < data.size(); i += 3) {
+                uint32_t x = ((unsigned char)data[i] << 16) | ((unsigned char)data[i+1] << 8) | (unsigned char)data[i+2];
+                out.push_back(chars[(x >> 18) & 63]);
+                out.push_back(chars[(x >> 12) & 63]);
+                out.push_back(chars[(x >> 6) & 63]);
+                out.push_back(chars[x & 63]);
+            }
+            if (i < data.size()) {
+                uint32_t x = (unsigned char)data[i] << 16;
+                if (i + 1 < data.size()) {
+                    x |= (unsigned char)data[i+1] << 8;
+                }
+                out.push_back(chars[(x >> 18) & 63]);
+                out.push_back(chars[(x >> 12) & 63]);
+                out.push_back(i + 1 < data.size() ? chars[(x >> 6) & 63] : '=');
+                out.push_back('=');
+            }
+            return out;
+        }
+
+        /**
+         * Write the objects of one kind, drawing batches of more than
+         * one object with instancing when it is enabled
+         * @return The number of draw calls the objects take
+         */
+        size_t writeBatches(SceneWriter& out, int kind, const vector<uint32_t>& meshAssetOf) const {
+            const char* kindNames[] = {"box", "cylinder", "cone", "ellipsoid"};
+            vector<uint32_t> order;
+            vector<size_t> starts;
+            size_t drawCalls = 0;
+            getBatches(kind, meshAssetOf, order, starts);
+            for (size_t b = 0; b+1 < starts.size(); b++) {
+                size_t first = starts[b];
+                size_t n = starts[b+1] - first;
+                if (!instancing || n < 2) {
+                    drawCalls += n;
+                    for (size_t j = first; j < first + n; j++) {
+                        if (kind == KIND_MESH) {
+                            writeMesh(out, order[j], meshAssetOf[order[j]]);
+                        }
+                        else {
+                            writePrimitive(out, kind, order[j]);
+                        }
+                    }
+                    continue;
+                }
+                if (kind == KIND_MESH) {
+                    out << "canvas.addInstancedMesh(" << meshAssetOf[order[first]] << ",";
+                    writeMaterial(out, meshes[0].material[order[first]]);
+                }
+                else {
+                    out << "canvas.addInstancedPrimitives(\"" << kindNames[kind] << "\",";
+                    writeMaterial(out, prims[kind].material[order[first]]);
+                }
+                out << ",[";
+                double t[9];
+                for (size_t j = first; j < first + n; j++) {
+                    getInstanceTransform(kind, order[j], t);
+                    for (int k = 0; k < 9; k++) {
+                        if (j > first || k > 0) {
+                            out << ",";
+                        }
+                        out << t[k];
+                    }
+                }
+                out << "]);\n";
+                drawCalls++;
+            }
+            return drawCalls;
+        }
+
+        /**
+         * Create a directory if it doesn't exist yet
+         * @return True if the directory exists now
+         */
+        static bool makeDirectory(const string& dir) {
+#ifdef _WIN32
+            _mkdir(dir.c_str());
+#else
+            mkdir(dir.c_str(), 0755);
+#endif
+            struct stat st;
+            return stat(dir.c_str(), &st) == 0 && (st.st_mode & S_IFDIR) != 0;
+        }
+
+        /**
+         * List the names of the files in a directory, leaving out
+         * subdirectories
+         */
+        static void listFiles(const string& dir, vector<string>& names) {
+            names.clear();
+#ifdef _WIN32
+            struct _finddata_t entry;
+            intptr_t handle = _findfirst((dir + "/*").c_str(), &entry);
+            if (handle == -1) {
+                return;
+            }
+            do {
+                if (!(entry.attrib & _A_SUBDIR)) {
+                    names.push_back(entry.name);
+                }
+            } while (_findnext(handle, &entry) == 0);
+            _findclose(handle);
+#else
+            DIR* d = opendir(dir.c_str());
+            if (d == NULL) {
+                return;
+            }
+            struct dirent* entry;
+            while ((entry = readdir(d)) != NULL) {
+                struct stat st;
+                if (stat((dir + "/" + entry->d_name).c_str(), &st) == 0 && !(st.st_mode & S_IFDIR)) {
+                    names.push_back(entry->d_name);
+                }
+            }
+            closedir(d);
+#endif
+        }
+
+        /**
+         * Write the JavaScript that hands a binary payload to a SceneCanvas
+         * method, either embedded as a base64 data URL or as a file
+         * @param method The method that fetches the payload
+         * @param payload The payload
+         * @param binPath Path of the file to write, or "" to embed it
+         * @param args More arguments to pass after the URL, starting with a comma
+         * @return False if binPath couldn't be written, in which case the
+         *         page isn't pointed at it
+         */
+        static bool writePayload(SceneWriter& out, const string& method, const string& payload, const string& binPath,
+                                 const string& args = "") {
+            if (binPath.size() == 0) {
+                out << "canvas." << method << "(\"data:application/octet-stream;base64," << base64(payload) << "\"" << args << ");\n";
+                return true;
+            }
+            ofstream bin(binPath.c_str(), ios::binary);
+            bin.write(payload.data(), payload.size());
+            bin.close();
+            if (bin.fail()) {
+                return false;
+            }
+            size_t slash = binPath.find_last_of("/\\");
+            out << "canvas." << method << "(\"" << (slash == string::npos ? binPath : binPath.substr(slash+1)) << "\"" << args << ");\n";
+            return true;
+        }
+
+        /**
+         * Bake every primitive into one triangle mesh per material, which
+         * canvas.loadMergedGeometry decodes.  The layout, all little endian, is
+         *
+         * "S3DG", uint32 version, uint32 numGroups
+         * numGroups x (float64 r, g, b, roughness, metalness,
+         *              uint32 numVertices, uint32 numTriangles, uint32 index size (2 or 4),
+         *              float32 positions, float32 normals, indices, padded to 4 bytes)
+         *
+         * @return The number of groups, each of which is one draw call
+         */
+        size_t packMergedPrimitives(string& buf) const {
+            ObjMesh unit[KIND_ELLIPSOID+1];
+            makeUnitBox(unit[KIND_BOX]);
+            makeUnitCylinder(unit[KIND_CYLINDER], 1);
+            makeUnitCylinder(unit[KIND_CONE], 0);
+            makeUnitSphere(unit[KIND_ELLIPSOID]);
+            vector<vector<ObjectRef> > byMaterial(materials.size());
+            for (int kind = KIND_BOX; kind <= KIND_ELLIPSOID; kind++) {
+                for (size_t i = 0; i < prims[kind].size(); i++) {
+                    ObjectRef ref = {(ObjectKind)kind, (uint32_t)i};
+                    byMaterial[prims[kind].material[i]].push_back(ref);
+                }
+            }
+            buf.append("S3DG", 4);
+            appendU32(buf, MERGED_VERSION);
+            size_t numGroupsPos = buf.size();
+            appendU32(buf, 0);
+            uint32_t numGroups = 0;
+            double t[9];
+            double x[15]; // Position, rotation matrix and scale
+            ObjMesh merged;
+            for (size_t m = 0; m < byMaterial.size(); m++) {
+                const vector<ObjectRef>& refs = byMaterial[m];
+                if (refs.size() == 0) {
+                    continue;
+                }
+                merged = ObjMesh();
+                for (size_t j = 0; j < refs.size(); j++) {
+                    getInstanceTransform(refs[j].kind, refs[j].index, t);
+                    double R[3][3];
+                    eulerToMatrix(t[3], t[4], t[5], R);
+                    for (int k = 0; k < 3; k++) {
+                        x[k] = t[k];
+                        x[12+k] = t[6+k];
+                        for (int c = 0; c < 3; c++) {
+                            x[3+k*3+c] = R[k][c];
+                        }
+                    }
+                    appendTransformed(merged, unit[refs[j].kind], x);
+                }
+                const Material& mat = materials[m];
+                appendF64(buf, mat.r);
+                appendF64(buf, mat.g);
+                appendF64(buf, mat.b);
+                appendF64(buf, mat.roughness);
+                appendF64(buf, mat.metalness);
+                uint32_t nv = (uint32_t)merged.numVertices();
+                bool shortIndices = nv <= 65536;
+                appendU32(buf, nv);
+                appendU32(buf, (uint32_t)merged.numTriangles());
+                appendU32(buf, shortIndices ? 2 : 4);
+                buf.append((const char*)&merged.positions[0], merged.positions.size()*sizeof(float));
+                buf.append((const char*)&merged.normals[0], merged.normals.size()*sizeof(float));
+                if (shortIndices) {
+                    for (size_t i = 0; i < merged.indices.size(); i++) {
+                        uint16_t idx = (uint16_t)merged.indices[i];
+                        buf.append((const char*)&idx, 2);
+                    }
+                    pad4(buf);
+                }
+                else {
+                    buf.append((const char*)&merged.indices[0], merged.indices.size()*sizeof(uint32_t));
+                }
+                numGroups++;
+            }
+            memcpy(&buf[numGroupsPos], &numGroups, 4);
+            return numGroups;
+        }
+
+        /**
+         * A square of the ground and the objects whose centers fall in it
+         */
+        struct Chunk {
+            long i, k;
+            AABB bounds; // Union of the bounding boxes of the objects
+            vector<uint32_t> objects[KIND_MESH+1];
+        };
+
+        /**
+         * Split the primitives and plain meshes into squares of the x/z
+         * plane chunkSize wide, and write each square as a binary payload in
+         * the chunk directory along with a manifest.json that lists the
+         * bounds of each one.  Objects wider than a square (like the ground)
+         * are embedded in the page so that they're always drawn.  Chunk
+         * files that the manifest doesn't list are removed
+         * @return False if the directory or one of its files couldn't be
+         *         written, in which case the page doesn't load the manifest
+         */
+        bool writeChunks(SceneWriter& out, const string& filename, const vector<uint32_t>& meshAssetOf) {
+            vector<Chunk> chunks;
+            map<pair<long, long>, size_t> chunkIndex;
+            vector<uint32_t> always[KIND_MESH+1];
+            AABB box;
+            for (int kind = KIND_BOX; kind <= KIND_MESH; kind++) {
+                size_t n = getNumBuffered((ObjectKind)kind);
+                for (size_t i = 0; i < n; i++) {
+                    computeBounds((ObjectKind)kind, i, box);
+                    if (box.max[0] - box.min[0] > chunkSize || box.max[2] - box.min[2] > chunkSize) {
+                        always[kind].push_back((uint32_t)i);
+                        continue;
+                    }
+                    pair<long, long> key((long)floor((box.min[0] + box.max[0])/2/chunkSize),
+                                         (long)floor((box.min[2] + box.max[2])/2/chunkSize));
+                    map<pair<long, long>, size_t>::iterator it = chunkIndex.find(key);
+                    if (it == chunkIndex.end()) {
+                        Chunk c;
+                        c.i = key.first;
+                        c.k = key.second;
+                        c.bounds = box;
+                        it = chunkIndex.insert(make_pair(key, chunks.size())).first;
+                        chunks.push_back(c);
+                    }
+                    Chunk& c = chunks[it->second];
+                    for (int d = 0; d < 3; d++) {
+                        c.bounds.min[d] = min(c.bounds.min[d], box.min[d]);
+                        c.bounds.max[d] = max(c.bounds.max[d], box.max[d]);
+                    }
+                    c.objects[kind].push_back((uint32_t)i);
+                }
+            }
+            string payload;
+            bool anyAlways = false;
+            for (int kind = KIND_BOX; kind <= KIND_MESH; kind++) {
+                anyAlways = anyAlways || always[kind].size() > 0;
+            }
+            if (anyAlways) {
+                stats.drawCalls += packBinaryScene(payload, meshAssetOf, always);
+                writePayload(out, "loadBinaryScene", payload, "");
+            }
+            string dir = getChunkDirectory(filename);
+            if (!makeDirectory(dir)) {
+                return false;
+            }
+            bool ok = true;
+            map<string, bool> written;
+            ofstream manifest((dir + "/manifest.json").c_str());
+            manifest << "{\"version\":" << BINARY_VERSION << ",\"chunkSize\":" << chunkSize;
+            manifest << ",\"loadRadius\":" << chunkLoadRadius << ",\"chunks\":[";
+            for (size_t c = 0; c < chunks.size(); c++) {
+                const Chunk& ch = chunks[c];
+                stringstream name;
+                name << ch.i << "_" << ch.k << ".bin";
+                payload.clear();
+                stats.drawCalls += packBinaryScene(payload, meshAssetOf, ch.objects);
+                ofstream bin((dir + "/" + name.str()).c_str(), ios::binary);
+                bin.write(payload.data(), payload.size());
+                bin.close();
+                ok = ok && !bin.fail();
+                written[name.str()] = true;
+                stats.bytes[BYTES_CHUNKS] += payload.size();
+                size_t count = 0;
+                for (int kind = KIND_BOX; kind <= KIND_MESH; kind++) {
+                    count += ch.objects[kind].size();
+                }
+                manifest << (c == 0 ? "" : ",") << "\n{\"file\":\"" << name.str() << "\",\"objects\":" << count;
+                manifest << ",\"bytes\":" << payload.size() << ",\"min\":[";
+                manifest << ch.bounds.min[0] << "," << ch.bounds.min[1] << "," << ch.bounds.min[2] << "],\"max\":[";
+                manifest << ch.bounds.max[0] << "," << ch.bounds.max[1] << "," << ch.bounds.max[2] << "]}";
+            }
+            manifest << "\n]}\n";
+            stats.bytes[BYTES_CHUNKS] += (double)manifest.tellp();
+            manifest.close();
+            ok = ok && !manifest.fail();
+
+            // Chunks left over from an earlier save with a different grid
+            // would never be loaded, so they're removed
+            vector<string> names;
+            listFiles(dir, names);
+            for (size_t i = 0; i < names.size(); i++) {
+                const string& n = names[i];
+                if (n.size() > 4 && n.compare(n.size() - 4, 4, ".bin") == 0 && written.find(n) == written.end()) {
+                    remove((dir + "/" + n).c_str());
+                }
+            }
+            if (!ok) {
+                return false;
+            }
+            size_t slash = dir.find_last_of("/\\");
+            out << "canvas.loadChunkManifest(\"" << (slash == string::npos ? dir : dir.substr(slash+1)) << "/manifest.json\");\n";
+            return true;
+        }
+
+        /**
+         * Count what's been written to out since mark towards a category
+         * of SceneStats, and move mark up to the end
+         */
+        static void countBytes(const SceneWriter& out, double* bytes, StatsCategory category, double& mark) {
+            bytes[category] += out.getNumBytes() - mark;
+            mark = out.getNumBytes();
+        }
+
+        void countBytes(const SceneWriter& out, StatsCategory category, double& mark) {
+            countBytes(out, stats.bytes, category, mark);
+        }
+
+        static void writeLights(SceneWriter& out, const vector<Light>& lights) {
+            for (size_t i = 0; i < lights.size(); i++) {
+                const Light& l = lights[i];
+                out << (l.directional ? "canvas.addDirectionalLight(" : "canvas.addPointLight(");
+                out << l.x << "," << l.y << "," << l.z << "," << l.r << "," << l.g << "," << l.b << "," << l.intensity << ");\n";
+            }
+        }
+
+        static void writeCameras(SceneWriter& out, const vector<Camera>& cameras) {
+            for (size_t i = 0; i < cameras.size(); i++) {
+                const Camera& c = cameras[i];
+                out << "canvas.addCamera(" << c.x << "," << c.y << "," << c.z << "," << c.rot << ");\n";
+            }
+        }
+
+        /**
+         * Write the JavaScript for every light, camera and object in the
+         * scene.  While streaming, this writes one block, always as
+         * JavaScript or embedded binary, and never merges primitives
+         * @return False if the chunks or binary files couldn't be written
+         */
+        bool writeSceneCode(SceneWriter& out, const string& filename) {
+            double mark = out.getNumBytes();
+            writeLights(out, lights);
+            countBytes(out, BYTES_LIGHTS, mark);
+            writeCameras(out, cameras);
+            countBytes(out, BYTES_CAMERAS, mark);
+            vector<uint32_t> meshAssetOf;
+            bool ok = writeObjects(out, filename, "", meshAssetOf);
+            if (visibilityCulling && outputMode != OUTPUT_BINARY_CHUNKED && stream == NULL) {
+                PhaseTimer timer(stats.seconds[PHASE_VISIBILITY]);
+                mark = out.getNumBytes();
+                vector<ObjectRef> ids;
+                getVisibilityOrder(ids, meshAssetOf, mergePrimitives);
+                writeVisibility(out, ids);
+                countBytes(out, BYTES_VISIBILITY, mark);
+            }
+            return ok;
+        }
+
+        /**
+         * Write the JavaScript for every object in the scene, along with
+         * the mesh assets they use
+         * @param filename Path of the scene file, which sidecar files and
+         *                 chunks are written next to
+         * @param bundleDir "" to write a scene, or the directory of a bundle
+         *                  shared by SceneVariants (see saveVariants), in
+         *                  which case binary payloads always go into
+         *                  files named after what's in them, and chunking
+         *                  falls back to a single binary file
+         * @param meshAssetOf Filled with the asset index of every plain mesh
+         * @return False if the chunks or binary files couldn't be written
+         */
+        bool writeObjects(SceneWriter& out, const string& filename, const string& bundleDir, vector<uint32_t>& meshAssetOf) {
+            double mark = out.getNumBytes();
+            size_t firstAsset = meshAssets.size();
+            vector<uint32_t> assetOf[2];
+            {
+                PhaseTimer timer(stats.seconds[PHASE_MESH_ASSETS]);
+                findMeshAssets(assetOf);
+                writeMeshAssets(out, meshAssets, firstAsset);
+            }
+            if (meshLods) {
+                PhaseTimer timer(stats.seconds[PHASE_MESH_LODS]);
+                writeMeshLods(out, meshAssets, firstAsset);
+            }
+            countBytes(out, BYTES_MESH_ASSETS, mark);
+            bool bundle = bundleDir.size() > 0;
+            bool streaming = stream != NULL;
+            bool chunked = outputMode == OUTPUT_BINARY_CHUNKED && !streaming && !bundle;
+            bool sidecar = outputMode == OUTPUT_BINARY_SIDECAR && !streaming;
+            bool merging = mergePrimitives && !chunked && !streaming;
+            bool culling = visibilityCulling && !chunked && !streaming;
+            bool ok = true;
+            vector<uint32_t> meshesOnly[KIND_MESH+1];
+            if (merging) {
+                PhaseTimer timer(stats.seconds[PHASE_MERGE_PRIMITIVES]);
+                string payload;
+                stats.drawCalls += packMergedPrimitives(payload);
+                string binPath = bundle ? getBundlePath(bundleDir, payload.data(), payload.size(), ".bin") : sidecar ? getMergedPath(filename) : "";
+                ok = writePayload(out, "loadMergedGeometry", payload, binPath);
+                if (ok && binPath.size() > 0) {
+                    stats.bytes[BYTES_MERGED] += payload.size();
+                }
+                countBytes(out, BYTES_MERGED, mark);
+                for (size_t i = 0; i < meshes[0].size(); i++) {
+                    meshesOnly[KIND_MESH].push_back((uint32_t)i);
+                }
+            }
+            {
+                PhaseTimer timer(stats.seconds[PHASE_OBJECTS]);
+                if (outputMode == OUTPUT_JS) {
+                    for (int kind = merging ? KIND_MESH : KIND_BOX; kind <= KIND_MESH; kind++) {
+                        stats.drawCalls += writeBatches(out, kind, assetOf[0]);
+                        countBytes(out, kind == KIND_MESH ? BYTES_MESHES : BYTES_PRIMITIVES, mark);
+                    }
+                }
+                else if (chunked) {
+                    ok = writeChunks(out, filename, assetOf[0]);
+                    countBytes(out, BYTES_CHUNKS, mark);
+                }
+                else {
+                    string payload;
+                    stats.drawCalls += packBinaryScene(payload, assetOf[0], merging ? meshesOnly : NULL);
+                    string args;
+                    if (culling) {
+                        // The textured meshes below are numbered first
+                        stringstream first;
+                        first << "," << meshes[1].size();
+                        args = first.str();
+                    }
+                    string binPath = bundle ? getBundlePath(bundleDir, payload.data(), payload.size(), ".bin") : sidecar ? getSidecarPath(filename) : "";
+                    if (!writePayload(out, "loadBinaryScene", payload, binPath, args)) {
+                        ok = false;
+                    }
+                    else if (binPath.size() > 0) {
+                        stats.bytes[BYTES_BINARY_SCENE] += payload.size();
+                    }
+                    countBytes(out, BYTES_BINARY_SCENE, mark);
+                }
+                const MeshArray& t = meshes[1];
+                for (size_t i = 0; i < t.size(); i++) {
+                    out << "canvas.addTexturedMeshRef(" << assetOf[1][i] << ",";
+                    writeTriple(out, t.center, i);
+                    out << ",";
+                    writeTriple(out, t.rot, i);
+                    out << ",";
+                    writeTriple(out, t.scale, i);
+                    out << "," << t.shininess[i] << ");\n";
+                }
+                stats.drawCalls += t.size();
+                countBytes(out, BYTES_TEXTURED_MESHES, mark);
+            }
+            meshAssetOf.swap(assetOf[0]);
+            return ok;
+        }
+
+        /**
+         * Number the objects that the viewer can show and hide in the order
+         * that it adds them: first everything added by JavaScript calls, in
+         * the order they're written, then the objects in a binary scene, in
+         * batch order.  Merged primitives aren't numbered
+         * @param ids Filled with the object that has each number
+         * @param meshAssetOf The asset index of every plain mesh
+         * @param merging True if primitives are merged
+         */
+        void getVisibilityOrder(vector<ObjectRef>& ids, const vector<uint32_t>& meshAssetOf, bool merging) const {
+            ids.clear();
+            bool binary = outputMode != OUTPUT_JS;
+            for (int pass = 0; pass < 2; pass++) {
+                if ((pass == 0) == binary) {
+                    for (size_t i = 0; i < meshes[1].size(); i++) {
+                        ObjectRef ref = {KIND_TEXTURED_MESH, (uint32_t)i};
+                        ids.push_back(ref);
+                    }
+                    continue;
+                }
+                vector<uint32_t> order;
+                vector<size_t> starts;
+                for (int kind = merging ? KIND_MESH : KIND_BOX; kind <= KIND_MESH; kind++) {
+                    getBatches(kind, meshAssetOf, order, starts);
+                    for (size_t j = 0; j < order.size(); j++) {
+                        ObjectRef ref = {(ObjectKind)kind, order[j]};
+                        ids.push_back(ref);
+                    }
+                }
+            }
+        }
+
+        /**
+         * Get ready to work out which objects can be seen: put every box into
+         * an occlusion tester (see Visibility.h), and look up the bounding
+         * box of every object that the viewer numbers
+         * @param ids The objects, in the order that the viewer numbers them
+         * @param self Filled with the occluder of each object, or NO_ENTRY
+         */
+        void prepareVisibility(const vector<ObjectRef>& ids, OcclusionTester& tester, vector<AABB>& targets, vector<uint32_t>& self) {
+            const PrimitiveArray& boxes = prims[KIND_BOX];
+            vector<uint32_t> occluderOf(boxes.size());
+            for (size_t i = 0; i < boxes.size(); i++) {
+                Occluder o;
+                eulerToMatrix(boxes.rot[i*3], boxes.rot[i*3+1], boxes.rot[i*3+2], o.R);
+                for (int k = 0; k < 3; k++) {
+                    o.center[k] = boxes.center[i*3+k];
+                    o.half[k] = fabs(boxes.dims[i*3+k])/2;
+                }
+                AABB bounds;
+                computeBounds(KIND_BOX, i, bounds);
+                occluderOf[i] = tester.addOccluder(o, bounds);
+            }
+            targets.resize(ids.size());
+            self.resize(ids.size());
+            for (size_t j = 0; j < ids.size(); j++) {
+                computeBounds(ids[j].kind, ids[j].index, targets[j]);
+                self[j] = ids[j].kind == KIND_BOX ? occluderOf[ids[j].index] : NO_ENTRY;
+            }
+        }
+
+        /**
+         * Write which objects can be seen from a camera as runs of
+         * (first number, count) for canvas.setCameraVisibility
+         * @param c The index of the camera
+         * @param numThreads Number of threads to check objects with, or 0
+         *                   to use one per core
+         */
+        static void writeCameraVisibility(SceneWriter& out, size_t c, const Camera& camera, const OcclusionTester& tester,
+                                          const vector<AABB>& targets, const vector<uint32_t>& self, unsigned numThreads) {
+            double eye[3] = {camera.x, camera.y, camera.z};
+            vector<char> visible;
+            tester.findVisible(eye, targets, self, visible, numThreads);
+            out << "canvas.setCameraVisibility(" << c << ",[";
+            bool first = true;
+            for (size_t j = 0; j < visible.size(); j++) {
+                if (visible[j] && (j == 0 || !visible[j-1])) {
+                    size_t end = j;
+                    while (end < visible.size() && visible[end]) {
+                        end++;
+                    }
+                    out << (first ? "" : ",") << j << "," << end - j;
+                    first = false;
+                }
+            }
+            out << "]);\n";
+        }
+
+        /**
+         * Work out which objects can be seen from each camera, with boxes
+         * blocking the view, and write them out
+         * @param ids The objects, in the order that the viewer numbers them
+         */
+        void writeVisibility(SceneWriter& out, const vector<ObjectRef>& ids) {
+            if (cameras.size() == 0) {
+                return;
+            }
+            OcclusionTester tester;
+            vector<AABB> targets;
+            vector<uint32_t> self;
+            prepareVisibility(ids, tester, targets, self);
+            for (size_t c = 0; c < cameras.size(); c++) {
+                writeCameraVisibility(out, c, cameras[c], tester, targets, self, 0);
+            }
+        }
+
+        static void writeSceneEnd(SceneWriter& out, const string& sceneName) {
+            out << "canvas.name = \"" << sceneName << "\";\n";
+            out << "canvas.repaint();\n</script>";
+            out << HTML_END;
+        }
+
+        /**
+         * Write out every light, camera and object being held while
+         * streaming, and then drop them from memory
+         */
+        void writeStreamBlock() {
+            PhaseTimer timer(stats.seconds[PHASE_SAVE]);
+            writeSceneCode(*stream, streamFilename);
+            for (int kind = KIND_BOX; kind < NUM_OBJECT_KINDS; kind++) {
+                numStreamed[kind] += getNumBuffered((ObjectKind)kind);
+            }
+            numStreamedLights += lights.size();
+            numStreamedCameras += cameras.size();
+            for (int kind = KIND_BOX; kind <= KIND_ELLIPSOID; kind++) {
+                prims[kind].clear();
+            }
+            meshes[0].clear();
+            meshes[1].clear();
+            cameras.clear();
+            lights.clear();
+        }
+
+        /**
+         * Write out a block once STREAM_BLOCK_OBJECTS objects are being held
+         */
+        void streamIfFull() {
+            size_t n = 0;
+            for (int kind = KIND_BOX; kind < NUM_OBJECT_KINDS; kind++) {
+                n += getNumBuffered((ObjectKind)kind);
+            }
+            if (n >= STREAM_BLOCK_OBJECTS) {
+                writeStreamBlock();
+            }
+        }
+
+        bool writeVariant(const string& directory, const SceneVariant& variant, const string& bundleName,
+                          const OcclusionTester* tester, const vector<AABB>& targets, const vector<uint32_t>& self,
+                          double* bytes) const;
+
+        /**
+         * Finish off the stats of a save that has just been written: work
+         * out how long building took, write the report if there should be
+         * one, and warn if the scene is over budget
+         * @param filename Path of the scene file
+         */
+        void finishSaveStats(const string& filename) {
+            chrono::steady_clock::time_point now = chrono::steady_clock::now();
+            stats.seconds[PHASE_BUILD] = chrono::duration<double>(now - lastSaved).count() - stats.seconds[PHASE_SAVE];
+            stats.seconds[PHASE_MERGE] = mergeSeconds;
+            lastSaved = now;
+            mergeSeconds = 0;
+            if (statsReport && !saveStats(getStatsPath(filename))) {
+                cerr << "Warning: Could not write " << getStatsPath(filename) << endl;
+            }
+            if (!isWithinBudget()) {
+                SceneStats s = getStats();
+                cerr << "Warning: " << filename << " is over budget, with " << (long long)s.drawCalls << " draw calls and ";
+                cerr << (long long)s.triangles << " triangles" << endl;
+            }
+        }
 
     public:
         Scene3D() {
-            sceneCode << "let canvas = new SceneCanvas();\n";
+            instancing = true;
+            meshCache = false;
+            meshLods = false;
+            mergePrimitives = false;
+            visibilityCulling = false;
+            outputMode = OUTPUT_JS;
+            chunkSize = 100;
+            chunkLoadRadius = 200;
+            indexed = false;
+            rejectOverlaps = false;
+            for (int kind = KIND_BOX; kind < NUM_OBJECT_KINDS; kind++) {
+                numStreamed[kind] = 0;
+            }
+            numStreamedLights = 0;
+            numStreamedCameras = 0;
+            stats = SceneStats();
+            lastSaved = chrono::steady_clock::now();
+            mergeSeconds = 0;
+            statsReport = false;
+            maxDrawCalls = 0;
+            maxTriangles = 0;
+        }
+
+        /**
+         * Choose whether objects of the same kind that share a material
+         * (and, for meshes, a file path) are exported as instanced batches
+         * that three.js draws with a single draw call each.  This is
+         * on by default
+         * @param on True to export instanced batches, false to export
+         *           every object with its own call
+         */
+        void setInstancing(bool on) {
+            instancing = on;
+        }
+
+        /**
+         * Choose whether plain meshes are exported as references to compact
+         * binary caches (see ObjMesh.h) instead of to their OBJ files.  The
+         * caches are written next to the OBJ files when the scene is saved,
+         * and are only rebuilt when the OBJ files change
+         * @param on True to export binary mesh caches
+         */
+        void setMeshCache(bool on) {
+            meshCache = on;
+        }
+
+        /**
+         * Choose whether all of the boxes, cylinders, cones and ellipsoids
+         * are baked, at save time, into one triangle mesh per material, so
+         * that the viewer draws each material with a single draw call no
+         * matter how the primitives are placed.  This is best for up to tens
+         * of thousands of primitives with mostly different shapes.  The
+         * merged mesh stores every vertex, so ellipsoids (about 1000
+         * vertices each) make it large quickly.  The mesh is embedded in
+         * the page, or written next to it with OUTPUT_BINARY_SIDECAR.
+         * OUTPUT_BINARY_CHUNKED does not merge
+         * @param on True to merge primitives
+         */
+        void setMergePrimitives(bool on) {
+            mergePrimitives = on;
+        }
+
+        /**
+         * Choose whether to work out, when the scene is saved, which objects
+         * can be seen from each camera, so that the viewer only draws those
+         * while it's looking from one of the cameras.  Boxes (like buildings)
+         * block the view; other shapes never do.  Looking around doesn't
+         * matter, but as soon as the camera moves away, everything is drawn
+         * again.  Merged primitives are always drawn, and nothing is worked
+         * out for OUTPUT_BINARY_CHUNKED or while streaming
+         * @param on True to work out which objects each camera can see
+         */
+        void setVisibilityCulling(bool on) {
+            visibilityCulling = on;
+        }
+
+        /**
+         * Choose whether a report of getStats is written as JSON next to
+         * the scene (see getStatsPath) every time it's saved
+         * @param on True to write the report
+         */
+        void setStatsReport(bool on) {
+            statsReport = on;
+        }
+
+        /**
+         * Set limits on how many draw calls and triangles the scene should
+         * take (see getStats).  A warning is printed when a scene that goes
+         * over is saved, the report says so, and isWithinBudget returns
+         * false, so that a build can fail
+         * @param maxDrawCalls Most draw calls allowed, or 0 for no limit
+         * @param maxTriangles Most triangles allowed, or 0 for no limit
+         */
+        void setBudget(double maxDrawCalls, double maxTriangles) {
+            this->maxDrawCalls = maxDrawCalls;
+            this->maxTriangles = maxTriangles;
+        }
+
+        /**
+         * Choose whether plain meshes get simplified levels of detail that
+         * the viewer switches to as they get farther from the camera.  The
+         * levels are made when the scene is saved, in parallel, and cached
+         * next to the OBJ files (see MeshSimplify.h) so that they're only
+         * rebuilt when the OBJ files change.  Textured meshes are always
+         * drawn in full, since the simplified levels don't keep texture
+         * coordinates
+         * @param on True to export levels of detail
+         */
+        void setMeshLods(bool on) {
+            meshLods = on;
+        }
+
+        /**
+         * Choose how primitives and plain meshes are written by saveScene.
+         * OUTPUT_JS writes JavaScript calls.  OUTPUT_BINARY_EMBEDDED packs
+         * them into compact typed arrays embedded in the page as base64, and
+         * OUTPUT_BINARY_SIDECAR writes those arrays to a .bin file next to
+         * the page.  OUTPUT_BINARY_CHUNKED splits them up by location into
+         * files that the viewer loads as the camera comes near (see
+         * setChunking).  The binary modes always draw with instancing
+         * @param mode The output mode
+         */
+        void setOutputMode(OutputMode mode) {
+            outputMode = mode;
+        }
+
+        /**
+         * Choose how scenes saved with OUTPUT_BINARY_CHUNKED are split up.
+         * The x/z plane is cut into squares, and the primitives and plain
+         * meshes whose centers fall in each square are written to their own
+         * file in a directory next to the page.  The viewer only loads the
+         * squares within a distance of the camera, and drops them again once
+         * the camera moves far enough away
+         * @param chunkSize Width of each square
+         * @param loadRadius How close the camera has to come to the objects
+         *                   in a square before they are loaded
+         */
+        void setChunking(double chunkSize, double loadRadius) {
+            this->chunkSize = chunkSize;
+            this->chunkLoadRadius = loadRadius;
+        }
+
+        /**
+         * Start keeping a uniform grid over the bounding boxes of all objects
+         * in the scene, so that they can be looked up by location with
+         * queryBox and queryRadius.  Objects already in the scene are added
+         * to the grid right away.  Mesh bounds are read from the mesh files
+         * @param cellSize Width of each grid column.  This works best
+         *                 when it's around the size of a typical object
+         */
+        void enableSpatialIndex(double cellSize = 10) {
+            if (indexed) {
+                return;
+            }
+            indexed = true;
+            spatialIndex = SpatialIndex(cellSize);
+            size_t first[NUM_OBJECT_KINDS] = {0};
+            indexObjects(first);
+        }
+
+        /**
+         * Choose whether objects that would share some volume with an object
+         * that's already in the scene are rejected by the add methods.
+         * Objects that only touch are still added.  Turning this on enables
+         * the spatial index with its default cell size if it isn't already.
+         * Objects brought in by merge are never rejected
+         * @param on True to reject overlapping objects
+         */
+        void setRejectOverlaps(bool on) {
+            if (on) {
+                enableSpatialIndex();
+            }
+            rejectOverlaps = on;
+        }
+
+        /**
+         * Compute the axis-aligned bounding box of an object in the scene.
+         * Objects that have already been written out by streaming can't be
+         * looked up
+         * @param ref The object
+         * @param box Filled with the bounding box
+         * @return False if the object has been written out, or doesn't exist
+         */
+        bool getBounds(ObjectRef ref, AABB& box) {
+            if (ref.index < numStreamed[ref.kind] || ref.index >= getNumObjects(ref.kind)) {
+                return false;
+            }
+            computeBounds(ref.kind, ref.index - numStreamed[ref.kind], box);
+            return true;
+        }
+
+        /**
+         * Find every object whose bounding box overlaps or touches a region.
+         * The spatial index must be enabled
+         * @param region The region to search
+         * @param out Filled with the objects that were found
+         */
+        void queryBox(const AABB& region, vector<ObjectRef>& out) const {
+            spatialIndex.queryBox(region, queryIds);
+            out.clear();
+            for (size_t i = 0; i < queryIds.size(); i++) {
+                out.push_back(indexRefs[queryIds[i]]);
+            }
+        }
+
+        /**
+         * Find every object whose bounding box comes within a distance of a
+         * point.  The spatial index must be enabled
+         * @param x X coordinate of the point
+         * @param y Y coordinate of the point
+         * @param z Z coordinate of the point
+         * @param radius The distance
+         * @param out Filled with the objects that were found
+         */
+        void queryRadius(double x, double y, double z, double radius, vector<ObjectRef>& out) const {
+            spatialIndex.queryRadius(x, y, z, radius, queryIds);
+            out.clear();
+            for (size_t i = 0; i < queryIds.size(); i++) {
+                out.push_back(indexRefs[queryIds[i]]);
+            }
+        }
+
+        /**
+         * Return true if a region shares some volume with the bounding box
+         * of any object in the scene.  The spatial index must be enabled
+         * @param region The region to check
+         */
+        bool isOccupied(const AABB& region) const {
+            return spatialIndex.overlapsAny(region);
+        }
+
+        /**
+         * Return the path of the binary file written next to a scene
+         * saved with OUTPUT_BINARY_SIDECAR
+         * @param filename Path of the scene file
+         */
+        static string getSidecarPath(const string& filename) {
+            size_t dot = filename.find_last_of('.');
+            size_t slash = filename.find_last_of("/\\");
+            if (dot == string::npos || (slash != string::npos && dot < slash)) {
+                return filename + ".bin";
+            }
+            return filename.substr(0, dot) + ".bin";
+        }
+
+        /**
+         * Return the path of the binary file of merged primitives written
+         * next to a scene saved with setMergePrimitives and
+         * OUTPUT_BINARY_SIDECAR
+         * @param filename Path of the scene file
+         */
+        static string getMergedPath(const string& filename) {
+            string bin = getSidecarPath(filename);
+            return bin.substr(0, bin.size() - 4) + "_merged.bin";
+        }
+
+        /**
+         * Return the path of the directory of chunk files written next to
+         * a scene saved with OUTPUT_BINARY_CHUNKED
+         * @param filename Path of the scene file
+         */
+        static string getChunkDirectory(const string& filename) {
+            string bin = getSidecarPath(filename);
+            return bin.substr(0, bin.size() - 4) + "_chunks";
+        }
+
+        /**
+         * Return the path of a file in the bundle written by saveVariants,
+         * which is named after a hash of what's in it so that variants of
+         * the same scene share it, and saving again doesn't change it
+         * @param directory The directory of the bundle
+         * @param data What's in the file
+         * @param len Its length in bytes
+         * @param extension The extension of the file, starting with a dot
+         */
+        static string getBundlePath(const string& directory, const char* data, size_t len, const string& extension) {
+            char name[32];
+            snprintf(name, sizeof(name), "bundle_%016llx", (unsigned long long)hashBytes(data, len));
+            return (directory.size() == 0 ? "" : directory + "/") + name + extension;
+        }
+
+        /**
+         * Return the path of the JSON report written next to a scene
+         * saved with setStatsReport
+         * @param filename Path of the scene file
+         */
+        static string getStatsPath(const string& filename) {
+            string bin = getSidecarPath(filename);
+            return bin.substr(0, bin.size() - 4) + "_stats.json";
+        }
+
+        /**
+         * Return the number of objects of a particular kind that have
+         * been added to the scene so far
+         * @param kind The kind of object
+         */
+        size_t getNumObjects(ObjectKind kind) const {
+            return numStreamed[kind] + getNumBuffered(kind);
+        }
+
+        /**
+         * Return the number of unique materials used by primitives
+         * and plain meshes
+         */
+        size_t getNumMaterials() const {
+            return materials.size();
+        }
+
+        /**
+         * Return the number of unique mesh and material file paths
+         */
+        size_t getNumPaths() const {
+            return paths.size();
+        }
+
+        /**
+         * Reserve space ahead of time for objects of a particular kind
+         * @param kind The kind of object
+         * @param n The total number of objects of this kind expected
+         */
+        void reserve(ObjectKind kind, size_t n) {
+            if (kind <= KIND_ELLIPSOID) {
+                PrimitiveArray& a = prims[kind];
+                a.center.reserve(n*3);
+                a.dims.reserve(n*3);
+                a.rot.reserve(n*3);
+                if (kind == KIND_CYLINDER || kind == KIND_CONE) {
+                    a.scale.reserve(n*3);
+                }
+                a.material.reserve(n);
+            }
+            else {
+                MeshArray& m = meshes[kind - KIND_MESH];
+                m.path.reserve(n);
+                m.center.reserve(n*3);
+                m.rot.reserve(n*3);
+                m.scale.reserve(n*3);
+                if (kind == KIND_MESH) {
+                    m.material.reserve(n);
+                }
+                else {
+                    m.matpath.reserve(n);
+                    m.shininess.reserve(n);
+                }
+            }
         }
         
         /**
@@ -45,13 +1974,16 @@ class Scene3D {
          * @param rx Rotation about x-axis, in degrees
          * @param ry Rotation about y-axis, in degrees
          * @param rz Rotation about z-axis, in degrees
+         * @return True if the object was added, or false if it was rejected
+         *         because it overlaps another object (see setRejectOverlaps)
          */
-        void addBox(double cx, double cy, double cz, double xlen, 
+        bool addBox(double cx, double cy, double cz, double xlen, 
                         double ylen, double zlen, 
                         double r, double g, double b,
                         double roughness, double metalness,
                         double rx, double ry, double rz) {
-            sceneCode << "canvas.addBox(" << cx << "," << cy << "," << cz << "," << xlen << "," << ylen << "," << zlen << "," << r << "," << g << "," << b << "," << roughness << "," << metalness << "," << rx << "," << ry << "," << rz << ");\n";
+            addPrimitive(KIND_BOX, cx, cy, cz, xlen, ylen, zlen, r, g, b, roughness, metalness, rx, ry, rz);
+            return placeObject(KIND_BOX);
         }
         
         /**
@@ -67,12 +1999,14 @@ class Scene3D {
          * @param b Blue component in [0, 255]
          * @param roughness How rough the material appears. 0.0 means a smooth mirror reflection, 1.0 means fully diffuse. https://threejs.org/docs/#api/en/materials/MeshStandardMaterial.roughness
          * @param metalness How much the material is like a metal. Non-metallic materials such as wood or stone use 0.0, metallic use 1.0, with nothing (usually) in between. https://threejs.org/docs/#api/en/materials/MeshStandardMaterial.metalness
+         * @return True if the object was added, or false if it was rejected
+         *         because it overlaps another object (see setRejectOverlaps)
          */
-        void addBox(double cx, double cy, double cz,
+        bool addBox(double cx, double cy, double cz,
                             double xlen, double ylen, double zlen,
                             double r, double g, double b,
                             double roughness, double metalness) {
-            addBox(cx, cy, cz, xlen, ylen, zlen, r, g, b, roughness, metalness, 0, 0, 0);
+            return addBox(cx, cy, cz, xlen, ylen, zlen, r, g, b, roughness, metalness, 0, 0, 0);
         }
         
         /**
@@ -93,13 +2027,17 @@ class Scene3D {
          * @param sx Scale about x-axis
          * @param sy Scale about y-axis
          * @param sz Scale about z-axis
+         * @return True if the object was added, or false if it was rejected
+         *         because it overlaps another object (see setRejectOverlaps)
          */
-        void addCylinder(double cx, double cy, double cz, double radius, 
+        bool addCylinder(double cx, double cy, double cz, double radius, 
                                 double height, double r, double g, double b,
                                 double roughness, double metalness,
                                 double rx, double ry, double rz,
                                 double sx, double sy, double sz) {
-            sceneCode << "canvas.addCylinder(" << cx << "," << cy << "," << cz << "," << radius << "," << height << "," << r << "," << g << "," << b << "," << roughness << "," << metalness << "," << rx << "," << ry << "," << rz << "," << sx << "," << sy << "," << sz << ");\n";
+            addPrimitive(KIND_CYLINDER, cx, cy, cz, radius, height, 0, r, g, b, roughness, metalness, rx, ry, rz);
+            push3(prims[KIND_CYLINDER].scale, sx, sy, sz);
+            return placeObject(KIND_CYLINDER);
         }
         
         /**
@@ -114,11 +2052,13 @@ class Scene3D {
          * @param b Blue component in [0, 255]
          * @param roughness How rough the material appears. 0.0 means a smooth mirror reflection, 1.0 means fully diffuse. https://threejs.org/docs/#api/en/materials/MeshStandardMaterial.roughness
          * @param metalness How much the material is like a metal. Non-metallic materials such as wood or stone use 0.0, metallic use 1.0, with nothing (usually) in between. https://threejs.org/docs/#api/en/materials/MeshStandardMaterial.metalness
+         * @return True if the object was added, or false if it was rejected
+         *         because it overlaps another object (see setRejectOverlaps)
          */
-        void addCylinder(double cx, double cy, double cz, double radius, 
+        bool addCylinder(double cx, double cy, double cz, double radius, 
                                 double height, double r, double g, double b,
                                 double roughness, double metalness) {
-            addCylinder(cx, cy, cz, radius, height, r, g, b, roughness, metalness, 0, 0, 0, 1, 1, 1);
+            return addCylinder(cx, cy, cz, radius, height, r, g, b, roughness, metalness, 0, 0, 0, 1, 1, 1);
         }
         
         /**
@@ -139,13 +2079,17 @@ class Scene3D {
          * @param sx Scale about x-axis
          * @param sy Scale about y-axis
          * @param sz Scale about z-axis
+         * @return True if the object was added, or false if it was rejected
+         *         because it overlaps another object (see setRejectOverlaps)
          */
-        void addCone(double cx, double cy, double cz, double radius, 
+        bool addCone(double cx, double cy, double cz, double radius, 
                                 double height, double r, double g, double b,
                                 double roughness, double metalness,
                                 double rx, double ry, double rz,
                                 double sx, double sy, double sz) {
-            sceneCode << "canvas.addCone(" << cx << "," << cy << "," << cz << "," << radius << "," << height << "," << r << "," << g << "," << b << "," << roughness << "," << metalness << "," << rx << "," << ry << "," << rz << "," << sx << "," << sy << "," << sz << ");";
+            addPrimitive(KIND_CONE, cx, cy, cz, radius, height, 0, r, g, b, roughness, metalness, rx, ry, rz);
+            push3(prims[KIND_CONE].scale, sx, sy, sz);
+            return placeObject(KIND_CONE);
         }
         
         /**
@@ -160,11 +2104,13 @@ class Scene3D {
          * @param b Blue component in [0, 255]
          * @param roughness How rough the material appears. 0.0 means a smooth mirror reflection, 1.0 means fully diffuse. https://threejs.org/docs/#api/en/materials/MeshStandardMaterial.roughness
          * @param metalness How much the material is like a metal. Non-metallic materials such as wood or stone use 0.0, metallic use 1.0, with nothing (usually) in between. https://threejs.org/docs/#api/en/materials/MeshStandardMaterial.metalness
+         * @return True if the object was added, or false if it was rejected
+         *         because it overlaps another object (see setRejectOverlaps)
          */
-        void addCone(double cx, double cy, double cz, double radius, 
+        bool addCone(double cx, double cy, double cz, double radius, 
                                 double height, double r, double g, double b,
                                 double roughness, double metalness) {
-            addCone(cx, cy, cz, radius, height, r, g, b, roughness, metalness, 0, 0, 0, 1, 1, 1);
+            return addCone(cx, cy, cz, radius, height, r, g, b, roughness, metalness, 0, 0, 0, 1, 1, 1);
         }
 
         /**
@@ -183,13 +2129,16 @@ class Scene3D {
          * @param rx Rotation about x-axis, in degrees
          * @param ry Rotation about y-axis, in degrees
          * @param rz Rotation about z-axis, in degrees
+         * @return True if the object was added, or false if it was rejected
+         *         because it overlaps another object (see setRejectOverlaps)
          */
-        void addEllipsoid(double cx, double cy, double cz, 
+        bool addEllipsoid(double cx, double cy, double cz, 
                                 double radx, double rady, double radz,
                                 double r, double g, double b, 
                                 double roughness, double metalness,
                                 double rx, double ry, double rz) {
-            sceneCode << "canvas.addEllipsoid(" << cx << "," << cy << "," << cz << "," << radx << "," << rady << "," << radz << "," << r << "," << g << "," << b << "," << roughness << "," << metalness << "," << rx << "," << ry << "," << rz << ");\n";
+            addPrimitive(KIND_ELLIPSOID, cx, cy, cz, radx, rady, radz, r, g, b, roughness, metalness, rx, ry, rz);
+            return placeObject(KIND_ELLIPSOID);
         }
         
         /**
@@ -205,12 +2154,14 @@ class Scene3D {
          * @param b Blue component in [0, 255]
          * @param roughness How rough the material appears. 0.0 means a smooth mirror reflection, 1.0 means fully diffuse. https://threejs.org/docs/#api/en/materials/MeshStandardMaterial.roughness
          * @param metalness How much the material is like a metal. Non-metallic materials such as wood or stone use 0.0, metallic use 1.0, with nothing (usually) in between. https://threejs.org/docs/#api/en/materials/MeshStandardMaterial.metalness
+         * @return True if the object was added, or false if it was rejected
+         *         because it overlaps another object (see setRejectOverlaps)
          */
-        void addEllipsoid(double cx, double cy, double cz, 
+        bool addEllipsoid(double cx, double cy, double cz, 
                                 double radx, double rady, double radz,
                                 double r, double g, double b,
                                 double roughness, double metalness) {
-            addEllipsoid(cx, cy, cz, radx, rady, radz, r, g, b, roughness, metalness, 0, 0, 0);
+            return addEllipsoid(cx, cy, cz, radx, rady, radz, r, g, b, roughness, metalness, 0, 0, 0);
         }
         
         /**
@@ -224,11 +2175,13 @@ class Scene3D {
          * @param b Blue component in [0, 255]
          * @param roughness How rough the material appears. 0.0 means a smooth mirror reflection, 1.0 means fully diffuse. https://threejs.org/docs/#api/en/materials/MeshStandardMaterial.roughness
          * @param metalness How much the material is like a metal. Non-metallic materials such as wood or stone use 0.0, metallic use 1.0, with nothing (usually) in between. https://threejs.org/docs/#api/en/materials/MeshStandardMaterial.metalness
+         * @return True if the object was added, or false if it was rejected
+         *         because it overlaps another object (see setRejectOverlaps)
          */
-        void addSphere(double cx, double cy, double cz, double radius,
+        bool addSphere(double cx, double cy, double cz, double radius,
                             double r, double g, double b,
                             double roughness, double metalness) {
-            addEllipsoid(cx, cy, cz, radius, radius, radius, r, g, b, roughness, metalness);
+            return addEllipsoid(cx, cy, cz, radius, radius, radius, r, g, b, roughness, metalness);
         }
         
         /**
@@ -249,14 +2202,23 @@ class Scene3D {
          * @param b Blue component in [0, 255]
          * @param roughness How rough the material appears. 0.0 means a smooth mirror reflection, 1.0 means fully diffuse. https://threejs.org/docs/#api/en/materials/MeshStandardMaterial.roughness
          * @param metalness How much the material is like a metal. Non-metallic materials such as wood or stone use 0.0, metallic use 1.0, with nothing (usually) in between. https://threejs.org/docs/#api/en/materials/MeshStandardMaterial.metalness
+         * @return True if the object was added, or false if it was rejected
+         *         because it overlaps another object (see setRejectOverlaps)
          */
-        void addMesh(string path, 
+        bool addMesh(string path, 
                         double cx, double cy, double cz, 
                         double rx, double ry, double rz,
                         double sx, double sy, double sz,
                         double r, double g, double b,
                         double roughness, double metalness) {
-            sceneCode << "canvas.addMesh(\"" << path << "\"," << cx << "," << cy << "," << cz << "," << rx << "," << ry << "," << rz << "," << sx << "," << sy << "," << sz << "," << r << "," << g << "," << b << "," << roughness << "," << metalness << ");\n";
+            MeshArray& m = meshes[0];
+            m.path.push_back(internPath(path));
+            push3(m.center, cx, cy, cz);
+            push3(m.rot, rx, ry, rz);
+            push3(m.scale, sx, sy, sz);
+            m.material.push_back(internMaterial(r, g, b, roughness, metalness));
+            meshUses[m.path.back()]++;
+            return placeObject(KIND_MESH);
         }
 
         /**
@@ -274,13 +2236,23 @@ class Scene3D {
         * @param sy Scale along y-axis
         * @param sz Scale along z-axis
         * @param shininess A number in [0, 255] describing how shiny the mesh is
+        * @return True if the object was added, or false if it was rejected
+        *         because it overlaps another object (see setRejectOverlaps)
         */
-        void addTexturedMesh(string path, string matpath,
+        bool addTexturedMesh(string path, string matpath,
                         double cx, double cy, double cz, 
                         double rx, double ry, double rz,
                         double sx, double sy, double sz,
                         double shininess) {
-            sceneCode << "canvas.addTexturedMesh(\"" << path << "\",\"" << matpath << "\"," << cx << "," << cy << "," << cz << "," << rx << "," << ry << "," << rz << "," << sx << "," << sy << "," << sz << "," << shininess << ");\n";
+            MeshArray& m = meshes[1];
+            m.path.push_back(internPath(path));
+            m.matpath.push_back(internPath(matpath));
+            push3(m.center, cx, cy, cz);
+            push3(m.rot, rx, ry, rz);
+            push3(m.scale, sx, sy, sz);
+            m.shininess.push_back(shininess);
+            meshUses[m.path.back()]++;
+            return placeObject(KIND_TEXTURED_MESH);
         }
         
         
@@ -292,7 +2264,8 @@ class Scene3D {
          * @param rot Rotation in degrees about y-axis
          */
         void addCamera(double x, double y, double z, double rot) {
-            sceneCode << "canvas.addCamera(" << x << "," << y << "," << z << "," << rot << ");\n";
+            Camera c = {x, y, z, rot};
+            cameras.push_back(c);
         }
         
         /**
@@ -307,7 +2280,8 @@ class Scene3D {
          * @param intensity The intensity of the light, in [0, 1]
          */
         void addPointLight(double x, double y, double z, double r, double g, double b, double intensity) {
-            sceneCode << "canvas.addPointLight(" << x << "," << y << "," << z << "," << r << "," << g << "," << b << "," << intensity << ");\n";
+            Light l = {false, x, y, z, r, g, b, intensity};
+            lights.push_back(l);
         }
 
         /**
@@ -323,24 +2297,683 @@ class Scene3D {
          * @param intensity The intensity of the light, in [0, 1]
          */
         void addDirectionalLight(double x, double y, double z, double r, double g, double b, double intensity) {
-            sceneCode << "canvas.addDirectionalLight(" << x << "," << y << "," << z << "," << r << "," << g << "," << b << "," << intensity << ");\n";
+            Light l = {true, x, y, z, r, g, b, intensity};
+            lights.push_back(l);
+        }
+
+        /**
+         * Append all of the lights, cameras and objects of other scenes to
+         * this one, in order, after everything that has already been added.
+         * The other scenes' materials and paths are merged into this scene's
+         * tables first, and then their objects are copied into place by
+         * several threads at once.  A scene can be merged into itself, in
+         * which case a copy of it is appended.  Scenes that are streaming,
+         * or that have streamed anything out, can't be merged into another,
+         * since what's been written out isn't in memory any more
+         * @param sources The scenes to append
+         * @param numThreads Number of threads to copy with
+         * @return False, without changing anything, if one of the other
+         *         scenes has streamed
+         */
+        bool merge(const vector<const Scene3D*>& sources, unsigned numThreads = 1) {
+            PhaseTimer timer(mergeSeconds);
+            vector<const Scene3D*> others(sources);
+            shared_ptr<Scene3D> snapshot; // This scene as it was, if it's one of the others
+            for (size_t sh = 0; sh < others.size(); sh++) {
+                if (others[sh] == this) {
+                    if (!snapshot) {
+                        snapshot = make_shared<Scene3D>(*this);
+                        snapshot->stream.reset();
+                    }
+                    others[sh] = snapshot.get();
+                }
+                if (others[sh]->hasStreamed()) {
+                    return false;
+                }
+            }
+            size_t S = others.size();
+            size_t firstOfKind[NUM_OBJECT_KINDS];
+            for (int kind = KIND_BOX; kind < NUM_OBJECT_KINDS; kind++) {
+                firstOfKind[kind] = getNumBuffered((ObjectKind)kind);
+            }
+            vector<vector<uint32_t> > materialMaps(S), pathMaps(S);
+            for (size_t sh = 0; sh < S; sh++) {
+                const Scene3D& other = *others[sh];
+                for (size_t i = 0; i < other.materials.size(); i++) {
+                    const Material& m = other.materials[i];
+                    materialMaps[sh].push_back(internMaterial(m.r, m.g, m.b, m.roughness, m.metalness));
+                }
+                for (size_t i = 0; i < other.paths.size(); i++) {
+                    pathMaps[sh].push_back(internPath(other.paths[i]));
+                    meshUses[pathMaps[sh][i]] += other.meshUses[i];
+                }
+                cameras.insert(cameras.end(), other.cameras.begin(), other.cameras.end());
+                lights.insert(lights.end(), other.lights.begin(), other.lights.end());
+            }
+
+            // Every array that gets appended, and whether it holds material
+            // or path indices that need to be remapped
+            vector<vector<double>*> doubleDst;
+            vector<vector<const vector<double>*> > doubleSrc;
+            vector<vector<uint32_t>*> indexDst;
+            vector<vector<const vector<uint32_t>*> > indexSrc;
+            vector<bool> indexIsPath;
+            vector<double> PrimitiveArray::* primDoubles[] = {&PrimitiveArray::center, &PrimitiveArray::dims, &PrimitiveArray::rot, &PrimitiveArray::scale};
+            vector<double> MeshArray::* meshDoubles[] = {&MeshArray::center, &MeshArray::rot, &MeshArray::scale, &MeshArray::shininess};
+            vector<uint32_t> MeshArray::* meshIndices[] = {&MeshArray::path, &MeshArray::matpath, &MeshArray::material};
+            for (int kind = KIND_BOX; kind < NUM_OBJECT_KINDS; kind++) {
+                bool isPrim = kind <= KIND_ELLIPSOID;
+                for (int f = 0; f < 4; f++) {
+                    doubleDst.push_back(isPrim ? &(prims[kind].*primDoubles[f]) : &(meshes[kind - KIND_MESH].*meshDoubles[f]));
+                    doubleSrc.push_back(vector<const vector<double>*>());
+                    for (size_t sh = 0; sh < S; sh++) {
+                        doubleSrc.back().push_back(isPrim ? &(others[sh]->prims[kind].*primDoubles[f]) : &(others[sh]->meshes[kind - KIND_MESH].*meshDoubles[f]));
+                    }
+                }
+                for (int f = 0; f < (isPrim ? 1 : 3); f++) {
+                    indexDst.push_back(isPrim ? &prims[kind].material : &(meshes[kind - KIND_MESH].*meshIndices[f]));
+                    indexSrc.push_back(vector<const vector<uint32_t>*>());
+                    for (size_t sh = 0; sh < S; sh++) {
+                        indexSrc.back().push_back(isPrim ? &others[sh]->prims[kind].material : &(others[sh]->meshes[kind - KIND_MESH].*meshIndices[f]));
+                    }
+                    indexIsPath.push_back(!isPrim && f < 2);
+                }
+            }
+
+            // Find where each scene's part of each array starts, and make room
+            vector<vector<size_t> > doubleStart(doubleDst.size()), indexStart(indexDst.size());
+            for (size_t a = 0; a < doubleDst.size(); a++) {
+                size_t n = doubleDst[a]->size();
+                for (size_t sh = 0; sh < S; sh++) {
+                    doubleStart[a].push_back(n);
+                    n += doubleSrc[a][sh]->size();
+                }
+                doubleDst[a]->resize(n);
+            }
+            for (size_t a = 0; a < indexDst.size(); a++) {
+                size_t n = indexDst[a]->size();
+                for (size_t sh = 0; sh < S; sh++) {
+                    indexStart[a].push_back(n);
+                    n += indexSrc[a][sh]->size();
+                }
+                indexDst[a]->resize(n);
+            }
+
+            atomic<size_t> next(0);
+            auto work = [&]() {
+                for (size_t sh = next.fetch_add(1); sh < S; sh = next.fetch_add(1)) {
+                    for (size_t a = 0; a < doubleDst.size(); a++) {
+                        const vector<double>& src = *doubleSrc[a][sh];
+                        copy(src.begin(), src.end(), doubleDst[a]->begin() + doubleStart[a][sh]);
+                    }
+                    for (size_t a = 0; a < indexDst.size(); a++) {
+                        const vector<uint32_t>& src = *indexSrc[a][sh];
+                        const vector<uint32_t>& remap = indexIsPath[a] ? pathMaps[sh] : materialMaps[sh];
+                        uint32_t* dst = indexDst[a]->data() + indexStart[a][sh];
+                        for (size_t i = 0; i < src.size(); i++) {
+                            dst[i] = remap[src[i]];
+                        }
+                    }
+                }
+            };
+            vector<thread> threads;
+            for (unsigned t = 1; t < numThreads && t < S; t++) {
+                threads.push_back(thread(work));
+            }
+            work();
+            for (size_t t = 0; t < threads.size(); t++) {
+                threads[t].join();
+            }
+            if (indexed) {
+                indexObjects(firstOfKind);
+            }
+            if (stream) {
+                streamIfFull();
+            }
+            return true;
+        }
+
+        /**
+         * Append all of the lights, cameras and objects of another scene to
+         * this one, after everything that has already been added
+         * @param other The scene to append
+         * @return False, without changing anything, if the other scene has streamed
+         */
+        bool merge(const Scene3D& other) {
+            return merge(vector<const Scene3D*>(1, &other));
         }
 
         /**
          * Save this scene to a file
          * @param filename Path to which to save file (should end with .json)
          * @param sceneName Title of the scene to display in the viewer
+         * @return True if the file was written.  Nothing is saved once the
+         *         scene has started streaming, since saving would start the
+         *         mesh assets over in the middle of the streamed file, and
+         *         what has been streamed out isn't in memory any more
          */
-        void saveScene(string filename, string sceneName) {
-            std::ofstream out(filename.c_str());
-            out << HTML_PREFIX;
-            out << "<script>\n";
-            out << sceneCode.str();
-            out << "canvas.name = \"" << sceneName << "\";\n";
-            out << "canvas.repaint();\n</script>";
-            out << HTML_END;
-            out.close();
+        bool saveScene(string filename, string sceneName) {
+            if (hasStreamed()) {
+                return false;
+            }
+            stats = SceneStats();
+            bool ok;
+            {
+                PhaseTimer timer(stats.seconds[PHASE_SAVE]);
+                SceneWriter out;
+                if (!out.open(filename)) {
+                    return false;
+                }
+                double mark = 0;
+                out << HTML_PREFIX;
+                out << "<script>\n";
+                out << "let canvas = new SceneCanvas();\n";
+                countBytes(out, BYTES_PAGE, mark);
+                meshAssets.clear();
+                meshAssetIndex.clear();
+                ok = writeSceneCode(out, filename);
+                mark = out.getNumBytes();
+                writeSceneEnd(out, sceneName);
+                countBytes(out, BYTES_PAGE, mark);
+                ok = out.close() && ok;
+            }
+            finishSaveStats(filename);
+            return ok;
+        }
+
+        /**
+         * Start writing this scene to a file while it's being built, instead
+         * of all at once with saveScene, so that memory use stays flat no
+         * matter how big the scene gets.  Whenever STREAM_BLOCK_OBJECTS
+         * objects have been added, they're written out as a block (batched
+         * with instancing within the block) and dropped from memory.
+         * finishStreaming writes the last block and closes the file.
+         * Blocks are written as JavaScript with OUTPUT_JS and as embedded
+         * binary with the other modes, and primitives aren't merged.  The
+         * spatial index keeps working, but getBounds can only look up
+         * objects that haven't been written out yet
+         * @param filename Path to which to save the scene
+         * @param sceneName Title of the scene to display in the viewer
+         * @return True if the file could be opened
+         */
+        bool beginStreaming(string filename, string sceneName) {
+            stream = make_shared<SceneWriter>();
+            if (!stream->open(filename)) {
+                stream.reset();
+                return false;
+            }
+            streamFilename = filename;
+            streamName = sceneName;
+            meshAssets.clear();
+            meshAssetIndex.clear();
+            stats = SceneStats();
+            double mark = 0;
+            *stream << HTML_PREFIX;
+            *stream << "<script>\n";
+            *stream << "let canvas = new SceneCanvas();\n";
+            countBytes(*stream, BYTES_PAGE, mark);
+            streamIfFull();
+            return true;
+        }
+
+        /**
+         * Return true if the scene is streaming, or has streamed, so that
+         * some of what was added to it is no longer in memory
+         */
+        bool hasStreamed() const {
+            if (stream || numStreamedLights > 0 || numStreamedCameras > 0) {
+                return true;
+            }
+            for (int kind = KIND_BOX; kind < NUM_OBJECT_KINDS; kind++) {
+                if (numStreamed[kind] > 0) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /**
+         * Return true if the scene is being streamed to a file
+         */
+        bool isStreaming() const {
+            return stream != NULL;
+        }
+
+        /**
+         * Write out everything that hasn't been written yet, finish
+         * the page, and close the file started by beginStreaming
+         * @return True if the whole scene was written successfully
+         */
+        bool finishStreaming() {
+            if (!stream) {
+                return false;
+            }
+            writeStreamBlock();
+            {
+                PhaseTimer timer(stats.seconds[PHASE_SAVE]);
+                double mark = stream->getNumBytes();
+                writeSceneEnd(*stream, streamName);
+                countBytes(*stream, BYTES_PAGE, mark);
+            }
+            bool ok = stream->close();
+            stream.reset();
+            finishSaveStats(streamFilename);
+            return ok;
+        }
+
+        /**
+         * Save several variants of this scene at once.  Everything in the
+         * scene except its lights and cameras is written once, as a bundle
+         * of a script and binary files named after what's in them (see
+         * getBundlePath).  Each variant then gets a small page of its own,
+         * with its lights, cameras and material replacements, that loads
+         * the bundle.  The pages are written by several threads at once.
+         * With setVisibilityCulling, what can be seen from each variant's
+         * cameras is worked out for its page.  The bundle always keeps
+         * binary scenes in files, even with OUTPUT_BINARY_EMBEDDED, and
+         * OUTPUT_BINARY_CHUNKED saves a single binary file instead of chunks.
+         * Nothing can be saved once the scene has started streaming.  The
+         * report from setStatsReport goes to variants_stats.json in the
+         * directory, with the bytes of the bundle and of every page
+         * @param directory Where to save the bundle and the pages, which
+         *                  have to be together so that the pages can find it
+         * @param variants The variants, each of which must be of this scene
+         * @param numThreads Number of threads to write pages with, or 0 to
+         *                   use one per core
+         * @return True if the bundle and every page were written
+         */
+        bool saveVariants(const string& directory, const vector<SceneVariant>& variants, unsigned numThreads = 0);
+
+        /**
+         * Count what's in the scene and estimate what it will cost the viewer.
+         * Objects, lights, cameras, materials, mesh files and triangles are
+         * counted as the scene is built, with the triangles of each mesh file
+         * taken from the counts at the top of the OBJ file.  Draw calls, bytes
+         * and times are for the last time the scene was saved or streamed, and
+         * are 0 before then.  Levels of detail and visibility culling aren't
+         * taken into account, so these are the costs when everything is close
+         * @return The stats
+         */
+        SceneStats getStats() {
+            SceneStats s = stats;
+            s.triangles = 0;
+            for (int kind = KIND_BOX; kind < NUM_OBJECT_KINDS; kind++) {
+                s.objects[kind] = getNumObjects((ObjectKind)kind);
+                if (kind <= KIND_ELLIPSOID) {
+                    s.triangles += (double)s.objects[kind]*getUnitTriangles(kind);
+                }
+            }
+            s.lights = numStreamedLights + lights.size();
+            s.cameras = numStreamedCameras + cameras.size();
+            s.materials = materials.size();
+            s.meshPaths = 0;
+            for (size_t p = 0; p < meshUses.size(); p++) {
+                if (meshUses[p] > 0) {
+                    s.meshPaths++;
+                    s.triangles += meshUses[p]*getMeshTriangles((uint32_t)p);
+                }
+            }
+            return s;
+        }
+
+        /**
+         * Return false if the scene takes more draw calls or triangles than
+         * setBudget allows
+         */
+        bool isWithinBudget() {
+            if (maxDrawCalls <= 0 && maxTriangles <= 0) {
+                return true;
+            }
+            SceneStats s = getStats();
+            return (maxDrawCalls <= 0 || s.drawCalls <= maxDrawCalls) && (maxTriangles <= 0 || s.triangles <= maxTriangles);
+        }
+
+        /**
+         * Write getStats to a file as JSON, along with the budget
+         * @param filename Path of the file
+         * @return True if the file was written
+         */
+        bool saveStats(string filename) {
+            const char* kindNames[] = {"box", "cylinder", "cone", "ellipsoid", "mesh", "texturedMesh"};
+            const char* byteNames[] = {"page", "lights", "cameras", "materialReplacements", "meshAssets", "primitives", "meshes",
+                                       "texturedMeshes", "binaryScene", "merged", "chunks", "visibility"};
+            const char* phaseNames[] = {"build", "merge", "meshAssets", "meshLods", "mergePrimitives", "objects", "visibility", "save"};
+            SceneStats s = getStats();
+            SceneWriter out;
+            if (!out.open(filename)) {
+                return false;
+            }
+            out << "{\n  \"objects\": {";
+            for (int kind = KIND_BOX; kind < NUM_OBJECT_KINDS; kind++) {
+                out << (kind == 0 ? "" : ", ") << "\"" << kindNames[kind] << "\": " << s.objects[kind];
+            }
+            out << "},\n";
+            out << "  \"lights\": " << s.lights << ",\n";
+            out << "  \"cameras\": " << s.cameras << ",\n";
+            out << "  \"materials\": " << s.materials << ",\n";
+            out << "  \"meshPaths\": " << s.meshPaths << ",\n";
+            out << "  \"triangles\": " << (long long)s.triangles << ",\n";
+            out << "  \"drawCalls\": " << (long long)s.drawCalls << ",\n";
+            out << "  \"bytes\": {";
+            double total = 0;
+            for (int c = 0; c < NUM_BYTE_CATEGORIES; c++) {
+                out << "\"" << byteNames[c] << "\": " << (long long)s.bytes[c] << ", ";
+                total += s.bytes[c];
+            }
+            out << "\"total\": " << (long long)total << "},\n";
+            out << "  \"seconds\": {";
+            for (int p = 0; p < NUM_PHASES; p++) {
+                out << (p == 0 ? "" : ", ") << "\"" << phaseNames[p] << "\": " << s.seconds[p];
+            }
+            out << "},\n";
+            out << "  \"budget\": {\"drawCalls\": " << (long long)maxDrawCalls << ", \"triangles\": " << (long long)maxTriangles;
+            out << ", \"withinBudget\": " << (isWithinBudget() ? "true" : "false") << "}\n";
+            out << "}\n";
+            return out.close();
+        }
+};
+
+/**
+ * A variant of a scene that only changes its lights, its cameras or the
+ * colors of its materials, for sweeps that render the same geometry many
+ * times (see Scene3D::saveVariants).  A variant starts out with the lights
+ * and cameras of its scene, and only copies them once it changes them, so
+ * copies of a variant are cheap too.  The scene has to outlive its variants
+ */
+class SceneVariant {
+    private:
+        const Scene3D* base;
+        string filename;
+        string sceneName;
+        shared_ptr<vector<Light> > lights; // NULL while the scene's lights are used
+        shared_ptr<vector<Camera> > cameras; // NULL while the scene's cameras are used
+        map<Material, Material> replacements;
+
+        /**
+         * Return a list that's only used by this variant, copying it
+         * from the scene or from the variant it was copied from first
+         */
+        template <typename T>
+        static vector<T>& own(shared_ptr<vector<T> >& list, const vector<T>& original) {
+            if (!list) {
+                list = make_shared<vector<T> >(original);
+            }
+            else if (list.use_count() > 1) {
+                list = make_shared<vector<T> >(*list);
+            }
+            return *list;
+        }
+
+    public:
+        /**
+         * @param base The scene that this is a variant of
+         * @param filename Name of the page to save the variant to, in the
+         *                 directory passed to saveVariants
+         * @param sceneName Title of the scene to display in the viewer
+         */
+        SceneVariant(const Scene3D& base, const string& filename, const string& sceneName):
+            base(&base), filename(filename), sceneName(sceneName) {}
+
+        const Scene3D& getBase() const {
+            return *base;
+        }
+
+        const string& getFilename() const {
+            return filename;
+        }
+
+        const string& getSceneName() const {
+            return sceneName;
+        }
+
+        const vector<Light>& getLights() const {
+            return lights ? *lights : base->lights;
+        }
+
+        const vector<Camera>& getCameras() const {
+            return cameras ? *cameras : base->cameras;
+        }
+
+        const map<Material, Material>& getMaterialReplacements() const {
+            return replacements;
+        }
+
+        /**
+         * Remove every light, including the scene's
+         */
+        void clearLights() {
+            lights = make_shared<vector<Light> >();
+        }
+
+        /**
+         * Add a point light after the ones already in the variant
+         * (see Scene3D::addPointLight)
+         */
+        void addPointLight(double x, double y, double z, double r, double g, double b, double intensity) {
+            Light l = {false, x, y, z, r, g, b, intensity};
+            own(lights, base->lights).push_back(l);
+        }
+
+        /**
+         * Add a directional light after the ones already in the variant
+         * (see Scene3D::addDirectionalLight)
+         */
+        void addDirectionalLight(double x, double y, double z, double r, double g, double b, double intensity) {
+            Light l = {true, x, y, z, r, g, b, intensity};
+            own(lights, base->lights).push_back(l);
+        }
+
+        /**
+         * Remove every camera, including the scene's
+         */
+        void clearCameras() {
+            cameras = make_shared<vector<Camera> >();
+        }
+
+        /**
+         * Add a camera after the ones already in the variant
+         * (see Scene3D::addCamera)
+         */
+        void addCamera(double x, double y, double z, double rot) {
+            Camera c = {x, y, z, rot};
+            own(cameras, base->cameras).push_back(c);
+        }
+
+        /**
+         * Draw everything in the scene that has one material with another
+         * instead.  Replacing the same material again overrides the last
+         * replacement
+         * @param from The material in the scene, as it was passed to the
+         *             add methods as (r, g, b, roughness, metalness)
+         * @param to The material to draw with instead
+         */
+        void replaceMaterial(const Material& from, const Material& to) {
+            replacements[from] = to;
         }
 };
 
+/**
+ * Write the page of one variant
+ * @param tester The boxes of the scene, or NULL if visibility isn't culled
+ * @param targets The bounding box of every object the viewer numbers
+ * @param self The occluder of each object, or NO_ENTRY
+ * @param bytes Where to count the bytes of the page, by SceneStats category
+ * @return True if the page was written
+ */
+inline bool Scene3D::writeVariant(const string& directory, const SceneVariant& variant, const string& bundleName,
+                                  const OcclusionTester* tester, const vector<AABB>& targets, const vector<uint32_t>& self,
+                                  double* bytes) const {
+    SceneWriter out;
+    if (!out.open(directory + "/" + variant.getFilename())) {
+        return false;
+    }
+    double mark = 0;
+    out << HTML_PREFIX;
+    out << "<script>\n";
+    out << "let canvas = new SceneCanvas();\n";
+    countBytes(out, bytes, BYTES_PAGE, mark);
+    const map<Material, Material>& replacements = variant.getMaterialReplacements();
+    for (map<Material, Material>::const_iterator it = replacements.begin(); it != replacements.end(); it++) {
+        const Material& a = it->first;
+        const Material& b = it->second;
+        out << "canvas.replaceMaterial(" << a.r << "," << a.g << "," << a.b << "," << a.roughness << "," << a.metalness << ",";
+        out << b.r << "," << b.g << "," << b.b << "," << b.roughness << "," << b.metalness << ");\n";
+    }
+    countBytes(out, bytes, BYTES_MATERIALS, mark);
+    writeLights(out, variant.getLights());
+    countBytes(out, bytes, BYTES_LIGHTS, mark);
+    const vector<Camera>& cams = variant.getCameras();
+    writeCameras(out, cams);
+    countBytes(out, bytes, BYTES_CAMERAS, mark);
+    out << "</script>\n";
+    out << "<script src=\"" << bundleName << "\"></script>\n";
+    out << "<script>\n";
+    countBytes(out, bytes, BYTES_PAGE, mark);
+    if (tester != NULL) {
+        for (size_t c = 0; c < cams.size(); c++) {
+            writeCameraVisibility(out, c, cams[c], *tester, targets, self, 1);
+        }
+        countBytes(out, bytes, BYTES_VISIBILITY, mark);
+    }
+    writeSceneEnd(out, variant.getSceneName());
+    countBytes(out, bytes, BYTES_PAGE, mark);
+    return out.close();
+}
+
+inline bool Scene3D::saveVariants(const string& directory, const vector<SceneVariant>& variants, unsigned numThreads) {
+    if (hasStreamed()) {
+        return false;
+    }
+    for (size_t v = 0; v < variants.size(); v++) {
+        if (&variants[v].getBase() != this) {
+            return false;
+        }
+    }
+    if (numThreads == 0) {
+        numThreads = thread::hardware_concurrency();
+    }
+    if (numThreads == 0) {
+        numThreads = 1;
+    }
+    stats = SceneStats();
+    bool ok = true;
+    {
+        PhaseTimer timer(stats.seconds[PHASE_SAVE]);
+        string dir = directory.size() == 0 ? "." : directory;
+        if (!makeDirectory(dir)) {
+            return false;
+        }
+
+        // The bundle's script is written under a temporary name, since
+        // its name depends on what's in it
+        string tmpPath = getTempPath(dir + "/bundle.js");
+        SceneWriter out;
+        if (!out.open(tmpPath)) {
+            return false;
+        }
+        meshAssets.clear();
+        meshAssetIndex.clear();
+        vector<uint32_t> meshAssetOf;
+        ok = writeObjects(out, tmpPath, dir, meshAssetOf);
+        ok = out.close() && ok;
+        MappedFile file;
+        if (!ok || !file.open(tmpPath)) {
+            remove(tmpPath.c_str());
+            return false;
+        }
+        string bundlePath = getBundlePath(dir, file.data(), file.size(), ".js");
+        file.close();
+        remove(bundlePath.c_str());
+        if (rename(tmpPath.c_str(), bundlePath.c_str()) != 0) {
+            remove(tmpPath.c_str());
+            return false;
+        }
+        string bundleName = bundlePath.substr(dir.size() + 1);
+
+        OcclusionTester tester;
+        vector<AABB> targets;
+        vector<uint32_t> self;
+        if (visibilityCulling) {
+            PhaseTimer timer(stats.seconds[PHASE_VISIBILITY]);
+            vector<ObjectRef> ids;
+            getVisibilityOrder(ids, meshAssetOf, mergePrimitives);
+            prepareVisibility(ids, tester, targets, self);
+        }
+
+        // Write the pages in parallel, with the bytes of each one counted
+        // separately and added up afterwards
+        vector<double> bytes(variants.size()*NUM_BYTE_CATEGORIES, 0);
+        vector<char> written(variants.size(), 0);
+        atomic<size_t> next(0);
+        auto work = [&]() {
+            for (size_t v = next.fetch_add(1); v < variants.size(); v = next.fetch_add(1)) {
+                written[v] = writeVariant(dir, variants[v], bundleName, visibilityCulling ? &tester : NULL, targets, self,
+                                          &bytes[v*NUM_BYTE_CATEGORIES]);
+            }
+        };
+        vector<thread> threads;
+        for (unsigned t = 1; t < numThreads && t < variants.size(); t++) {
+            threads.push_back(thread(work));
+        }
+        work();
+        for (size_t t = 0; t < threads.size(); t++) {
+            threads[t].join();
+        }
+        for (size_t v = 0; v < variants.size(); v++) {
+            ok = ok && written[v];
+            for (int c = 0; c < NUM_BYTE_CATEGORIES; c++) {
+                stats.bytes[c] += bytes[v*NUM_BYTE_CATEGORIES + c];
+            }
+        }
+    }
+    finishSaveStats(directory.size() == 0 ? "variants" : directory + "/variants");
+    return ok;
+}
+
+/**
+ * Build a scene in parallel by splitting it into regions (for example,
+ * rows of city blocks).  Each region is built into its own Scene3D shard
+ * by whichever worker thread picks it up, and then the shards are merged
+ * into the scene in region order, also in parallel.  Since the result
+ * only depends on the order of the regions, the saved scene is
+ * byte-identical no matter how many threads are used
+ * 
+ * @param scene The scene to which to add every region
+ * @param numRegions Number of regions to build
+ * @param buildRegion Function that adds everything in a region to a shard,
+ *                    called as buildRegion(shard, regionIndex).  It may be
+ *                    called from several threads at once
+ * @param numThreads Number of worker threads, or 0 to use one per core
+ */
+inline void buildInParallel(Scene3D& scene, size_t numRegions,
+                            function<void(Scene3D&, size_t)> buildRegion,
+                            unsigned numThreads = 0) {
+    if (numThreads == 0) {
+        numThreads = thread::hardware_concurrency();
+    }
+    if (numThreads == 0) {
+        numThreads = 1;
+    }
+    vector<Scene3D> shards(numRegions);
+    atomic<size_t> next(0);
+    auto work = [&]() {
+        for (size_t r = next.fetch_add(1); r < numRegions; r = next.fetch_add(1)) {
+            buildRegion(shards[r], r);
+        }
+    };
+    vector<thread> threads;
+    for (unsigned t = 1; t < numThreads; t++) {
+        threads.push_back(thread(work));
+    }
+    work();
+    for (size_t t = 0; t < threads.size(); t++) {
+        threads[t].join();
+    }
+    vector<const Scene3D*> others;
+    for (size_t r = 0; r < numRegions; r++) {
+        others.push_back(&shards[r]);
+    }
+    scene.merge(others, numThreads);
+}
+
 #endif
\ No newline at end of file
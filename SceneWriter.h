@@ -0,0 +1,263 @@
+/**
+ * This code writes scene files through a large buffer, formatting numbers
+ * itself instead of going through iostream, so that big scenes can be
+ * written quickly and a piece at a time
+ */
+#ifndef SCENEWRITER_H
+#define SCENEWRITER_H
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+#define WRITER_BUFFER_SIZE (1 << 20)
+#define NUMBER_CHARS 32 // Enough room for any number formatNumber writes
+
+/**
+ * Write a number with 6 significant digits and no trailing zeros, exactly
+ * the way printf's "%g" and iostream's default formatting do, so that
+ * scenes come out the same as they always have.  Numbers between 1e-4 and
+ * 1e6 (nearly all of the numbers in a scene) are formatted here directly,
+ * and everything else, along with the rare numbers that fall too close to
+ * halfway between two roundings to be sure about, goes to snprintf
+ * @param buf Where to write, with room for NUMBER_CHARS characters
+ * @param x The number
+ * @return The number of characters written
+ */
+inline int formatNumber(char* buf, double x) {
+    static const double pow10[] = {1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+    static const double lower[] = {1e-4, 1e-3, 1e-2, 1e-1, 1, 1e1, 1e2, 1e3, 1e4, 1e5};
+    double a = fabs(x);
+    if (x == 0 && !signbit(x)) {
+        buf[0] = '0';
+        return 1;
+    }
+    if (!(a >= 1e-4 && a < 1e6)) {
+        return snprintf(buf, NUMBER_CHARS, "%g", x);
+    }
+    // Find the decimal exponent e, then round to 6 digits m = a*10^(5-e)
+    int e = 5;
+    while (e > -4 && a < lower[e + 4]) {
+        e--;
+    }
+    double scaled = a*pow10[5 - e];
+    double whole = floor(scaled);
+    double frac = scaled - whole;
+    if (fabs(frac - 0.5) < 1e-9) {
+        return snprintf(buf, NUMBER_CHARS, "%g", x);
+    }
+    long m = (long)whole + (frac > 0.5 ? 1 : 0);
+    if (m >= 1000000) {
+        m /= 10;
+        e++;
+    }
+    if (m < 100000 || e > 5) {
+        return snprintf(buf, NUMBER_CHARS, "%g", x);
+    }
+    char digits[6];
+    for (int k = 5; k >= 0; k--) {
+        digits[k] = (char)('0' + m % 10);
+        m /= 10;
+    }
+    int last = 5; // Last digit to keep once trailing zeros are dropped
+    while (last > e && last > 0 && digits[last] == '0') {
+        last--;
+    }
+    int n = 0;
+    if (x < 0) {
+        buf[n++] = '-';
+    }
+    if (e < 0) {
+        buf[n++] = '0';
+        buf[n++] = '.';
+        for (int k = e + 1; k < 0; k++) {
+            buf[n++] = '0';
+        }
+        for (int k = 0; k <= last; k++) {
+            buf[n++] = digits[k];
+        }
+    }
+    else {
+        for (int k = 0; k <= last; k++) {
+            if (k == e + 1) {
+                buf[n++] = '.';
+            }
+            buf[n++] = digits[k];
+        }
+    }
+    return n;
+}
+
+/**
+ * Write an integer in decimal
+ * @param buf Where to write, with room for NUMBER_CHARS characters
+ * @param x The integer
+ * @return The number of characters written
+ */
+inline int formatInteger(char* buf, long long x) {
+    char tmp[NUMBER_CHARS];
+    int len = 0;
+    unsigned long long u = x < 0 ? 0ULL - (unsigned long long)x : (unsigned long long)x;
+    do {
+        tmp[len++] = (char)('0' + u % 10);
+        u /= 10;
+    } while (u > 0);
+    int n = 0;
+    if (x < 0) {
+        buf[n++] = '-';
+    }
+    while (len > 0) {
+        buf[n++] = tmp[--len];
+    }
+    return n;
+}
+
+/**
+ * Writes text to a file through a WRITER_BUFFER_SIZE buffer, with the
+ * same << syntax as an ostream.  Errors are remembered rather than
+ * thrown, and reported by close
+ */
+class SceneWriter {
+    private:
+        FILE* file;
+        vector<char> buf;
+        size_t used;
+        double written; // Bytes handed to the file so far
+        bool failed;
+
+        SceneWriter(const SceneWriter&) = delete;
+        SceneWriter& operator=(const SceneWriter&) = delete;
+
+    public:
+        SceneWriter() {
+            file = NULL;
+            used = 0;
+            written = 0;
+            failed = false;
+        }
+
+        ~SceneWriter() {
+            close();
+        }
+
+        /**
+         * Start writing to a file, replacing anything that's in it
+         * @param filename Path of the file
+         * @return True if the file could be opened
+         */
+        bool open(const string& filename) {
+            close();
+            file = fopen(filename.c_str(), "wb");
+            failed = file == NULL;
+            buf.resize(WRITER_BUFFER_SIZE);
+            used = 0;
+            written = 0;
+            return !failed;
+        }
+
+        bool isOpen() const {
+            return file != NULL;
+        }
+
+        /**
+         * Return the number of bytes written since open, including
+         * those that are still buffered
+         */
+        double getNumBytes() const {
+            return written + used;
+        }
+
+        /**
+         * Hand everything that's been buffered so far to the file
+         */
+        void flush() {
+            if (file != NULL && used > 0 && fwrite(&buf[0], 1, used, file) != used) {
+                failed = true;
+            }
+            written += used;
+            used = 0;
+        }
+
+        /**
+         * Flush and close the file
+         * @return True if everything since open was written successfully
+         */
+        bool close() {
+            flush();
+            if (file != NULL) {
+                if (fclose(file) != 0) {
+                    failed = true;
+                }
+                file = NULL;
+            }
+            return !failed;
+        }
+
+        void write(const char* s, size_t n) {
+            if (n > buf.size() - used) {
+                flush();
+                if (n > buf.size()) {
+                    if (file != NULL && fwrite(s, 1, n, file) != n) {
+                        failed = true;
+                    }
+                    written += n;
+                    return;
+                }
+            }
+            memcpy(&buf[used], s, n);
+            used += n;
+        }
+
+        SceneWriter& operator<<(const char* s) {
+            write(s, strlen(s));
+            return *this;
+        }
+
+        SceneWriter& operator<<(const string& s) {
+            write(s.data(), s.size());
+            return *this;
+        }
+
+        SceneWriter& operator<<(char c) {
+            write(&c, 1);
+            return *this;
+        }
+
+        SceneWriter& operator<<(double x) {
+            if (buf.size() - used < NUMBER_CHARS) {
+                flush();
+            }
+            used += formatNumber(&buf[used], x);
+            return *this;
+        }
+
+        SceneWriter& operator<<(long long x) {
+            if (buf.size() - used < NUMBER_CHARS) {
+                flush();
+            }
+            used += formatInteger(&buf[used], x);
+            return *this;
+        }
+
+        SceneWriter& operator<<(int x) {
+            return *this << (long long)x;
+        }
+
+        SceneWriter& operator<<(unsigned int x) {
+            return *this << (long long)x;
+        }
+
+        SceneWriter& operator<<(long x) {
+            return *this << (long long)x;
+        }
+
+        SceneWriter& operator<<(unsigned long x) {
+            return *this << (long long)x;
+        }
+};
+
+#endif
@@ -0,0 +1,304 @@
+/**
+ * This code keeps a uniform grid over axis-aligned bounding boxes so
+ * that objects near a point or inside a region can be found quickly.
+ * Cities are mostly spread out over the ground, so the grid is made of
+ * columns over the x/z plane
+ */
+#ifndef SPATIALINDEX_H
+#define SPATIALINDEX_H
+
+#include <vector>
+#include <unordered_map>
+#include <math.h>
+#include <stdint.h>
+
+using namespace std;
+
+#define GRID_COORD_BITS 31
+#define GRID_MAX_CELLS_PER_OBJECT 64
+#define OVERLAP_TOLERANCE 1e-7
+#define NO_ENTRY 0xFFFFFFFF
+
+/**
+ * An axis-aligned bounding box
+ */
+struct AABB {
+    double min[3];
+    double max[3];
+
+    /**
+     * Return true if this box and another share some volume.  Boxes
+     * that only touch along a face, edge or corner (up to rounding
+     * error of OVERLAP_TOLERANCE) don't overlap
+     */
+    bool overlaps(const AABB& other) const {
+        for (int k = 0; k < 3; k++) {
+            if (!(min[k] < other.max[k] - OVERLAP_TOLERANCE && other.min[k] < max[k] - OVERLAP_TOLERANCE)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Return true if this box and another overlap or touch
+     */
+    bool intersects(const AABB& other) const {
+        for (int k = 0; k < 3; k++) {
+            if (min[k] > other.max[k] || other.min[k] > max[k]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Return the squared distance from a point to the closest point
+     * in this box
+     */
+    double sqrDistTo(double x, double y, double z) const {
+        double p[3] = {x, y, z};
+        double d = 0;
+        for (int k = 0; k < 3; k++) {
+            double e = 0;
+            if (p[k] < min[k]) {
+                e = min[k] - p[k];
+            }
+            else if (p[k] > max[k]) {
+                e = p[k] - max[k];
+            }
+            d += e*e;
+        }
+        return d;
+    }
+};
+
+/**
+ * A uniform grid of x/z columns over axis-aligned boxes.  Each box is
+ * stored in every column it touches, except for boxes that touch more than
+ * GRID_MAX_CELLS_PER_OBJECT cells (like the ground), which are kept in a
+ * separate list that every query checks.  Boxes are identified by the
+ * order in which they were inserted.
+ *
+ * Queries are not safe to run from several threads at once
+ */
+class SpatialIndex {
+    private:
+        double cellSize;
+        vector<AABB> boxes;
+        unordered_map<uint64_t, uint32_t> cells; // Column to the first entry in it
+        vector<uint32_t> entryBox; // Box of each entry
+        vector<uint32_t> entryNext; // Next entry in the same column, or NO_ENTRY
+        vector<uint32_t> large;
+        mutable vector<uint32_t> lastQuery; // The query that last visited each box
+        mutable uint32_t queryCount;
+
+        long cellCoord(double x) const {
+            long c = (long)floor(x/cellSize);
+            long limit = 1L << (GRID_COORD_BITS - 1);
+            if (c < -limit) c = -limit;
+            if (c >= limit) c = limit - 1;
+            return c;
+        }
+
+        static uint64_t cellKey(long i, long k) {
+            long offset = 1L << (GRID_COORD_BITS - 1);
+            return ((uint64_t)(i + offset) << 32) | (uint64_t)(k + offset);
+        }
+
+        void cellRange(const AABB& box, long* lo, long* hi) const {
+            lo[0] = cellCoord(box.min[0]);
+            hi[0] = cellCoord(box.max[0]);
+            lo[1] = cellCoord(box.min[2]);
+            hi[1] = cellCoord(box.max[2]);
+        }
+
+        /**
+         * Call f(id) once for every box that might intersect a region.
+         * Stops early and returns true as soon as f returns true
+         */
+        template <typename F>
+        bool visit(const AABB& region, F f) const {
+            queryCount++;
+            if (queryCount == 0) {
+                // Wrapped around; forget which boxes have been visited
+                lastQuery.assign(lastQuery.size(), 0);
+                queryCount = 1;
+            }
+            for (size_t i = 0; i < large.size(); i++) {
+                if (f(large[i])) {
+                    return true;
+                }
+            }
+            long lo[2], hi[2];
+            cellRange(region, lo, hi);
+            for (long i = lo[0]; i <= hi[0]; i++) {
+                for (long k = lo[1]; k <= hi[1]; k++) {
+                    unordered_map<uint64_t, uint32_t>::const_iterator it = cells.find(cellKey(i, k));
+                    if (it == cells.end()) {
+                        continue;
+                    }
+                    for (uint32_t e = it->second; e != NO_ENTRY; e = entryNext[e]) {
+                        uint32_t id = entryBox[e];
+                        if (lastQuery[id] != queryCount) {
+                            lastQuery[id] = queryCount;
+                            if (f(id)) {
+                                return true;
+                            }
+                        }
+                    }
+                }
+            }
+            return false;
+        }
+
+    public:
+        /**
+         * @param cellSize Width of each grid column.  This works best
+         *                 when it's around the size of a typical object
+         */
+        SpatialIndex(double cellSize = 10) {
+            this->cellSize = cellSize;
+            queryCount = 0;
+        }
+
+        double getCellSize() const {
+            return cellSize;
+        }
+
+        size_t size() const {
+            return boxes.size();
+        }
+
+        const AABB& getBox(uint32_t id) const {
+            return boxes[id];
+        }
+
+        /**
+         * Add a box to the index
+         * @param box The box to add
+         * @return The id of the box
+         */
+        uint32_t insert(const AABB& box) {
+            uint32_t id = (uint32_t)boxes.size();
+            boxes.push_back(box);
+            lastQuery.push_back(0);
+            long lo[2], hi[2];
+            cellRange(box, lo, hi);
+            double numCells = (double)(hi[0] - lo[0] + 1)*(double)(hi[1] - lo[1] + 1);
+            if (numCells > GRID_MAX_CELLS_PER_OBJECT) {
+                large.push_back(id);
+                return id;
+            }
+            for (long i = lo[0]; i <= hi[0]; i++) {
+                for (long k = lo[1]; k <= hi[1]; k++) {
+                    pair<unordered_map<uint64_t, uint32_t>::iterator, bool> it = cells.insert(make_pair(cellKey(i, k), NO_ENTRY));
+                    entryBox.push_back(id);
+                    entryNext.push_back(it.first->second);
+                    it.first->second = (uint32_t)(entryBox.size() - 1);
+                }
+            }
+            return id;
+        }
+
+        /**
+         * Find every box that overlaps or touches a region
+         * @param region The region to search
+         * @param out Filled with the ids of the boxes that were found
+         */
+        void queryBox(const AABB& region, vector<uint32_t>& out) const {
+            out.clear();
+            const vector<AABB>& B = boxes;
+            visit(region, [&](uint32_t id) {
+                if (B[id].intersects(region)) {
+                    out.push_back(id);
+                }
+                return false;
+            });
+        }
+
+        /**
+         * Find every box that comes within a distance of a point
+         * @param x X coordinate of the point
+         * @param y Y coordinate of the point
+         * @param z Z coordinate of the point
+         * @param radius The distance
+         * @param out Filled with the ids of the boxes that were found
+         */
+        void queryRadius(double x, double y, double z, double radius, vector<uint32_t>& out) const {
+            out.clear();
+            AABB region = {{x - radius, y - radius, z - radius}, {x + radius, y + radius, z + radius}};
+            const vector<AABB>& B = boxes;
+            double r2 = radius*radius;
+            visit(region, [&](uint32_t id) {
+                if (B[id].sqrDistTo(x, y, z) <= r2) {
+                    out.push_back(id);
+                }
+                return false;
+            });
+        }
+
+        /**
+         * Call f(id) for every box that might touch the segment from a to b,
+         * walking the columns that the segment crosses in order.  Stops early
+         * and returns true as soon as f returns true.  A box that spans
+         * several columns can be passed to f more than once.  Unlike the
+         * other queries, this is safe to run from several threads at once
+         * @param a Start of the segment (x, y, z)
+         * @param b End of the segment (x, y, z)
+         */
+        template <typename F>
+        bool visitSegment(const double* a, const double* b, F f) const {
+            for (size_t i = 0; i < large.size(); i++) {
+                if (f(large[i])) {
+                    return true;
+                }
+            }
+            long i = cellCoord(a[0]), k = cellCoord(a[2]);
+            long iEnd = cellCoord(b[0]), kEnd = cellCoord(b[2]);
+            double dx = b[0] - a[0], dz = b[2] - a[2];
+            long si = dx > 0 ? 1 : -1, sk = dz > 0 ? 1 : -1;
+            // Distance along the segment (as a fraction) to the next column
+            // boundary in x and in z, and between boundaries
+            double tx = dx == 0 ? INFINITY : ((i + (dx > 0 ? 1 : 0))*cellSize - a[0])/dx;
+            double tz = dz == 0 ? INFINITY : ((k + (dz > 0 ? 1 : 0))*cellSize - a[2])/dz;
+            double stepX = dx == 0 ? INFINITY : cellSize/fabs(dx);
+            double stepZ = dz == 0 ? INFINITY : cellSize/fabs(dz);
+            while (true) {
+                unordered_map<uint64_t, uint32_t>::const_iterator it = cells.find(cellKey(i, k));
+                if (it != cells.end()) {
+                    for (uint32_t e = it->second; e != NO_ENTRY; e = entryNext[e]) {
+                        if (f(entryBox[e])) {
+                            return true;
+                        }
+                    }
+                }
+                if (i == iEnd && k == kEnd) {
+                    break;
+                }
+                // Never step past the last column along either axis, so that
+                // rounding error can't make the walk miss the end
+                if (k == kEnd || (i != iEnd && tx < tz)) {
+                    i += si;
+                    tx += stepX;
+                }
+                else {
+                    k += sk;
+                    tz += stepZ;
+                }
+            }
+            return false;
+        }
+
+        /**
+         * Return true if any box in the index shares some volume with a box
+         */
+        bool overlapsAny(const AABB& box) const {
+            const vector<AABB>& B = boxes;
+            return visit(box, [&](uint32_t id) {
+                return B[id].overlaps(box);
+            });
+        }
+};
+
+#endif
@@ -0,0 +1,247 @@
+/**
+ * This code finds which objects could be seen from a point, by casting
+ * rays from the point to the bounding box of each object and checking
+ * whether solid boxes (like buildings) are in the way.  Only boxes block
+ * the view, and a ray that gets through anywhere is enough for an object
+ * to count as visible, so most mistakes make the sets bigger than they
+ * need to be.  The test isn't conservative, though: rays are only cast
+ * to a grid of points on each face, so an object whose only visible part
+ * falls between the rays (say, seen through a narrow gap) is missed.  The
+ * grid gets finer as a face looks bigger from the eye to make that rarer
+ */
+#ifndef VISIBILITY_H
+#define VISIBILITY_H
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+#include "SpatialIndex.h"
+
+using namespace std;
+
+#define VISIBILITY_SAMPLES 3 // Fewest rays along each side of each face of a bounding box that faces the eye
+#define VISIBILITY_MAX_SAMPLES 8 // Most rays along each side of a face
+#define VISIBILITY_SAMPLE_ANGLE 0.1 // Rays along a side are at most about this many radians apart, up to VISIBILITY_MAX_SAMPLES
+#define VISIBILITY_INSET 0.02 // Rays aim this fraction of the way in from the edges of a face
+#define OCCLUDER_SHRINK 1e-4 // Occluders are shrunk by this much so that rays that graze them get through
+
+/**
+ * A box that blocks the view
+ */
+struct Occluder {
+    double center[3];
+    double R[3][3]; // Each column is one of the box's axes
+    double half[3]; // Half of the box's size along each axis
+};
+
+/**
+ * Return true if the segment from a to b passes through the inside of
+ * a box, shrunk by OCCLUDER_SHRINK on each side
+ */
+inline bool segmentHitsOccluder(const Occluder& o, const double* a, const double* b) {
+    double t0 = 0, t1 = 1;
+    for (int j = 0; j < 3; j++) {
+        double pa = 0, pb = 0;
+        for (int k = 0; k < 3; k++) {
+            pa += o.R[k][j]*(a[k] - o.center[k]);
+            pb += o.R[k][j]*(b[k] - o.center[k]);
+        }
+        double h = o.half[j] - OCCLUDER_SHRINK;
+        double d = pb - pa;
+        if (h <= 0) {
+            return false;
+        }
+        if (d == 0) {
+            if (fabs(pa) >= h) {
+                return false;
+            }
+            continue;
+        }
+        double ta = (-h - pa)/d, tb = (h - pa)/d;
+        if (ta > tb) {
+            swap(ta, tb);
+        }
+        t0 = max(t0, ta);
+        t1 = min(t1, tb);
+        if (t0 >= t1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Occluders kept in a grid so that the ones near a ray can be found quickly
+ */
+class OcclusionTester {
+    private:
+        vector<Occluder> occluders;
+        SpatialIndex index;
+
+    public:
+        /**
+         * @param cellSize Width of each grid column (see SpatialIndex)
+         */
+        OcclusionTester(double cellSize = 10): index(cellSize) {}
+
+        /**
+         * Add a box that blocks the view
+         * @param o The box
+         * @param bounds Its axis-aligned bounding box
+         * @return The id of the occluder
+         */
+        uint32_t addOccluder(const Occluder& o, const AABB& bounds) {
+            occluders.push_back(o);
+            return index.insert(bounds);
+        }
+
+        /**
+         * Find the occluders that contain a point.  Rays from an eye inside
+         * a box should see out of it, so these are skipped
+         * @param p The point
+         * @param out Filled with the ids of the occluders
+         */
+        void findContaining(const double* p, vector<uint32_t>& out) const {
+            out.clear();
+            index.visitSegment(p, p, [&](uint32_t id) {
+                if (find(out.begin(), out.end(), id) == out.end() && segmentHitsOccluder(occluders[id], p, p)) {
+                    out.push_back(id);
+                }
+                return false;
+            });
+        }
+
+        /**
+         * Return true if an occluder blocks the segment from a to b
+         * @param skip An occluder to ignore (the target itself), or NO_ENTRY
+         * @param ignore More occluders to ignore (see findContaining)
+         */
+        bool isBlocked(const double* a, const double* b, uint32_t skip, const vector<uint32_t>& ignore) const {
+            return index.visitSegment(a, b, [&](uint32_t id) {
+                if (id == skip || find(ignore.begin(), ignore.end(), id) != ignore.end()) {
+                    return false;
+                }
+                return segmentHitsOccluder(occluders[id], a, b);
+            });
+        }
+
+        /**
+         * Choose where along one side of a face to aim rays: the middle
+         * first, and then evenly from one end to the other, just inside
+         * the edges.  There are enough that neighbouring rays are about
+         * VISIBILITY_SAMPLE_ANGLE apart as seen from the eye
+         * @param length Length of the side
+         * @param dist Distance from the eye to the plane of the face
+         * @param t Filled with the fractions of the way along the side
+         * @return The number of fractions
+         */
+        static int getSamples(double length, double dist, double* t) {
+            double angle = length/max(dist, 1e-9);
+            int n = VISIBILITY_SAMPLES;
+            if (angle > VISIBILITY_SAMPLE_ANGLE*(n - 2)) {
+                n = (int)min((double)VISIBILITY_MAX_SAMPLES, ceil(angle/VISIBILITY_SAMPLE_ANGLE) + 2);
+            }
+            t[0] = 0.5;
+            for (int s = 1; s < n; s++) {
+                t[s] = VISIBILITY_INSET + (1 - 2*VISIBILITY_INSET)*(s - 1)/max(1, n - 2);
+            }
+            return n;
+        }
+
+        /**
+         * Return true if some part of a bounding box can be seen from an eye.
+         * Rays are cast to a grid of points on every face that faces the eye,
+         * middle first and then from corner to corner.  Each side of a face
+         * gets at least VISIBILITY_SAMPLES points, and more the wider it looks
+         * from the eye (see VISIBILITY_SAMPLE_ANGLE).  A visible part smaller
+         * than the spacing of the grid can be missed
+         * @param eye The eye
+         * @param box The bounding box of the target
+         * @param skip The target's own occluder, or NO_ENTRY
+         * @param ignore Occluders that contain the eye
+         */
+        bool isVisible(const double* eye, const AABB& box, uint32_t skip, const vector<uint32_t>& ignore) const {
+            bool inside = true;
+            for (int k = 0; k < 3; k++) {
+                inside = inside && eye[k] >= box.min[k] && eye[k] <= box.max[k];
+            }
+            if (inside) {
+                return true;
+            }
+            for (int k = 0; k < 3; k++) {
+                double face;
+                if (eye[k] < box.min[k]) {
+                    face = box.min[k];
+                }
+                else if (eye[k] > box.max[k]) {
+                    face = box.max[k];
+                }
+                else {
+                    continue;
+                }
+                int u = (k + 1) % 3, v = (k + 2) % 3;
+                double tu[VISIBILITY_MAX_SAMPLES], tv[VISIBILITY_MAX_SAMPLES];
+                double dist = fabs(face - eye[k]);
+                int nu = getSamples(box.max[u] - box.min[u], dist, tu);
+                int nv = getSamples(box.max[v] - box.min[v], dist, tv);
+                for (int su = 0; su < nu; su++) {
+                    for (int sv = 0; sv < nv; sv++) {
+                        double p[3];
+                        p[k] = face;
+                        p[u] = box.min[u] + tu[su]*(box.max[u] - box.min[u]);
+                        p[v] = box.min[v] + tv[sv]*(box.max[v] - box.min[v]);
+                        if (!isBlocked(eye, p, skip, ignore)) {
+                            return true;
+                        }
+                    }
+                }
+            }
+            return false;
+        }
+
+        /**
+         * Find which of a list of bounding boxes can be seen from an eye,
+         * checking them in parallel
+         * @param eye The eye
+         * @param targets The bounding boxes
+         * @param self The occluder of each target, or NO_ENTRY for targets
+         *             that aren't occluders
+         * @param visible Filled with 1 for each target that can be seen, or 0
+         * @param numThreads Number of worker threads, or 0 to use one per core
+         */
+        void findVisible(const double* eye, const vector<AABB>& targets, const vector<uint32_t>& self,
+                         vector<char>& visible, unsigned numThreads = 0) const {
+            vector<uint32_t> ignore;
+            findContaining(eye, ignore);
+            visible.assign(targets.size(), 0);
+            if (numThreads == 0) {
+                numThreads = thread::hardware_concurrency();
+            }
+            if (numThreads == 0) {
+                numThreads = 1;
+            }
+            const size_t blockSize = 1024;
+            atomic<size_t> next(0);
+            auto work = [&]() {
+                for (size_t first = next.fetch_add(blockSize); first < targets.size(); first = next.fetch_add(blockSize)) {
+                    size_t last = min(first + blockSize, targets.size());
+                    for (size_t i = first; i < last; i++) {
+                        visible[i] = isVisible(eye, targets[i], self[i], ignore) ? 1 : 0;
+                    }
+                }
+            };
+            vector<thread> threads;
+            for (unsigned t = 1; t < numThreads && t*blockSize < targets.size(); t++) {
+                threads.push_back(thread(work));
+            }
+            work();
+            for (size_t t = 0; t < threads.size(); t++) {
+                threads[t].join();
+            }
+        }
+};
+
+#endif
@@ -0,0 +1,390 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#ifndef _WIN32
+#include <dirent.h>
+#include <sys/resource.h>
+#endif
+#include "Scene3D.h"
+
+/**
+ * Builds a synthetic city with Scene3D and reports how long it takes to
+ * add objects and save the scene, how much memory that uses, and how big
+ * the output is, as JSON on stdout.  Run with --help for the options
+ */
+
+struct Options {
+    long prims;
+    long meshes;
+    long lights;
+    string mode;
+    bool instancing;
+    bool merge;
+    bool meshCache;
+    bool index;
+    long queries;
+    unsigned threads;
+    bool stream;
+    bool culling;
+    long variants;
+    bool stats;
+    double maxDrawCalls;
+    double maxTriangles;
+    string meshPath;
+    string out;
+};
+
+typedef chrono::steady_clock Clock;
+
+double secondsSince(Clock::time_point start) {
+    return chrono::duration<double>(Clock::now() - start).count();
+}
+
+/**
+ * Return the peak resident set size of this process so far, in bytes,
+ * or 0 if it isn't known on this platform
+ */
+double getPeakRSS() {
+#ifndef _WIN32
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return (double)usage.ru_maxrss;
+#else
+    return (double)usage.ru_maxrss*1024;
+#endif
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Return the size of a file in bytes, or 0 if it doesn't exist
+ */
+double getFileSize(const string& path) {
+    SourceStamp stamp;
+    return getFileStamp(path, stamp) ? (double)stamp.size : 0;
+}
+
+/**
+ * Return the total size of the files in a directory, or 0 if it
+ * doesn't exist
+ */
+double getDirectorySize(const string& path) {
+    double total = 0;
+#ifndef _WIN32
+    DIR* dir = opendir(path.c_str());
+    if (dir == NULL) {
+        return 0;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            total += getFileSize(path + "/" + entry->d_name);
+        }
+    }
+    closedir(dir);
+#endif
+    return total;
+}
+
+/**
+ * A fast deterministic pseudorandom number in [0, 1) for object i and
+ * stream k, so that generating the city costs little next to adding it
+ */
+double hashUnit(long i, int k) {
+    uint64_t x = (uint64_t)i*0x9E3779B97F4A7C15ULL + (uint64_t)k*0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 31;
+    x *= 0x94D049BB133111EBULL;
+    x ^= x >> 29;
+    return (x >> 11)*(1.0/9007199254740992.0);
+}
+
+/**
+ * Time adding n objects with a function that adds object i
+ * @return Nanoseconds per call
+ */
+template <typename F>
+double timeAdds(long n, F add) {
+    if (n <= 0) {
+        return 0;
+    }
+    Clock::time_point start = Clock::now();
+    for (long i = 0; i < n; i++) {
+        add(i);
+    }
+    return secondsSince(start)*1e9/n;
+}
+
+void printUsage() {
+    printf("Usage: benchmark [options]\n");
+    printf("  --prims=N        Number of primitives, split evenly over boxes, cylinders, cones and ellipsoids (default 1000000)\n");
+    printf("  --meshes=N       Number of meshes (default 1000)\n");
+    printf("  --lights=N       Number of point lights (default 8)\n");
+    printf("  --mode=MODE      js, embedded, sidecar or chunked (default js)\n");
+    printf("  --instancing=0|1 Export instanced batches (default 1)\n");
+    printf("  --merge=0|1      Bake primitives into one mesh per material (default 0)\n");
+    printf("  --meshcache=0|1  Export binary mesh caches (default 0)\n");
+    printf("  --index=0|1      Keep a spatial index while adding, and time queries on it (default 0)\n");
+    printf("  --queries=N      Number of spatial queries to time with --index (default 100000)\n");
+    printf("  --threads=N      Build the city with this many threads using buildInParallel, or 0 to add from one thread (default 0)\n");
+    printf("  --stream=0|1     Stream the scene to the file while adding, instead of saving it afterwards (default 0)\n");
+    printf("  --culling=0|1    Work out which objects each camera can see when saving (default 0)\n");
+    printf("  --variants=N     Save N variants of the city with different lights, cameras and mesh colors, sharing one bundle (default 0)\n");
+    printf("  --stats=0|1      Write a JSON report of the scene's stats next to it (default 0)\n");
+    printf("  --max-draw-calls=N  Exit with an error if the scene takes more draw calls than this (default 0, no limit)\n");
+    printf("  --max-triangles=N   Exit with an error if the scene has more triangles than this (default 0, no limit)\n");
+    printf("  --mesh=PATH      Mesh file to place (default meshes/homer.obj)\n");
+    printf("  --out=PATH       Where to save the scene (default benchmark.html)\n");
+}
+
+bool parseOptions(int argc, char** argv, Options& opt) {
+    opt.prims = 1000000;
+    opt.meshes = 1000;
+    opt.lights = 8;
+    opt.mode = "js";
+    opt.instancing = true;
+    opt.merge = false;
+    opt.meshCache = false;
+    opt.index = false;
+    opt.queries = 100000;
+    opt.threads = 0;
+    opt.stream = false;
+    opt.culling = false;
+    opt.variants = 0;
+    opt.stats = false;
+    opt.maxDrawCalls = 0;
+    opt.maxTriangles = 0;
+    opt.meshPath = "meshes/homer.obj";
+    opt.out = "benchmark.html";
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        string key = arg.substr(0, eq);
+        string value = eq == string::npos ? "" : arg.substr(eq + 1);
+        if (key == "--prims") opt.prims = atol(value.c_str());
+        else if (key == "--meshes") opt.meshes = atol(value.c_str());
+        else if (key == "--lights") opt.lights = atol(value.c_str());
+        else if (key == "--mode") opt.mode = value;
+        else if (key == "--instancing") opt.instancing = atoi(value.c_str()) != 0;
+        else if (key == "--merge") opt.merge = atoi(value.c_str()) != 0;
+        else if (key == "--meshcache") opt.meshCache = atoi(value.c_str()) != 0;
+        else if (key == "--index") opt.index = atoi(value.c_str()) != 0;
+        else if (key == "--queries") opt.queries = atol(value.c_str());
+        else if (key == "--threads") opt.threads = (unsigned)atoi(value.c_str());
+        else if (key == "--stream") opt.stream = atoi(value.c_str()) != 0;
+        else if (key == "--culling") opt.culling = atoi(value.c_str()) != 0;
+        else if (key == "--variants") opt.variants = atol(value.c_str());
+        else if (key == "--stats") opt.stats = atoi(value.c_str()) != 0;
+        else if (key == "--max-draw-calls") opt.maxDrawCalls = atof(value.c_str());
+        else if (key == "--max-triangles") opt.maxTriangles = atof(value.c_str());
+        else if (key == "--mesh") opt.meshPath = value;
+        else if (key == "--out") opt.out = value;
+        else {
+            printUsage();
+            return false;
+        }
+    }
+    if ((opt.mode != "js" && opt.mode != "embedded" && opt.mode != "sidecar" && opt.mode != "chunked") || (opt.stream && opt.variants > 0)) {
+        printUsage();
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Lay out object i of a city on a grid of 20 meter blocks, 100 blocks
+ * wide, with one object of each kind per slot
+ */
+void getSlot(long i, double& x, double& z) {
+    long slot = i/4;
+    x = (slot % 100)*20.0 + 10*hashUnit(i, 0);
+    z = (slot / 100)*20.0 + 10*hashUnit(i, 1);
+}
+
+void addPrimitive(Scene3D& scene, long i) {
+    double x, z;
+    getSlot(i, x, z);
+    double c = 100 + 10*(i % 8); // A handful of materials, as in a real city
+    double h = 2 + 20*hashUnit(i, 2);
+    switch (i % 4) {
+        case 0:
+            scene.addBox(x, h/2, z, 4, h, 4, c, c, 130, 1, 0, 0, 90*hashUnit(i, 3), 0);
+            break;
+        case 1:
+            scene.addCylinder(x, 1, z, 0.05, 2, 127, 127, 127, 1, 0);
+            break;
+        case 2:
+            scene.addCone(x, 3, z, 1.5, 3, 20, c, 20, 0.8, 0);
+            break;
+        default:
+            scene.addEllipsoid(x, 6, z, 2, 2.5, 2, 20, c, 20, 0.9, 0);
+    }
+}
+
+void addMeshAt(Scene3D& scene, const string& path, long i) {
+    double x, z;
+    getSlot(i*4, x, z);
+    scene.addMesh(path, x, 1.4, z + 5, 0, 360*hashUnit(i, 4), 0, 1, 1, 1, 255, 255, 0, 1, 0);
+}
+
+/**
+ * Make variant v of n of the city, sweeping the color of the sunlight,
+ * the position of the camera and the color of the meshes
+ */
+SceneVariant makeVariant(const Scene3D& scene, long v, long n) {
+    char filename[64], sceneName[64];
+    snprintf(filename, sizeof(filename), "benchmark_variant%ld.html", v);
+    snprintf(sceneName, sizeof(sceneName), "Benchmark variant %ld", v);
+    SceneVariant variant(scene, filename, sceneName);
+    double t = (v + 0.5)/n;
+    variant.clearLights();
+    variant.addDirectionalLight(100, 200, 100, 255, 200 + 55*t, 255 - 55*t, 0.5 + 0.5*t);
+    variant.clearCameras();
+    variant.addCamera(2000*t, 2, 0, 360*t);
+    Material from = {255, 255, 0, 1, 0};
+    Material to = {255*t, 255, 255*(1 - t), 1, 0};
+    variant.replaceMaterial(from, to);
+    return variant;
+}
+
+int main(int argc, char** argv) {
+    Options opt;
+    if (!parseOptions(argc, argv, opt)) {
+        return 1;
+    }
+    Scene3D scene;
+    scene.setInstancing(opt.instancing);
+    scene.setMergePrimitives(opt.merge);
+    scene.setMeshCache(opt.meshCache);
+    scene.setVisibilityCulling(opt.culling);
+    scene.setStatsReport(opt.stats);
+    scene.setBudget(opt.maxDrawCalls, opt.maxTriangles);
+    if (opt.mode == "embedded") scene.setOutputMode(OUTPUT_BINARY_EMBEDDED);
+    else if (opt.mode == "sidecar") scene.setOutputMode(OUTPUT_BINARY_SIDECAR);
+    else if (opt.mode == "chunked") scene.setOutputMode(OUTPUT_BINARY_CHUNKED);
+    if (opt.index) {
+        scene.enableSpatialIndex();
+    }
+    double rssStart = getPeakRSS();
+    if (opt.stream && !scene.beginStreaming(opt.out, "Benchmark")) {
+        fprintf(stderr, "Could not open %s\n", opt.out.c_str());
+        return 1;
+    }
+
+    // Add everything, timing each kind of call separately
+    double nsLight = timeAdds(opt.lights, [&](long i) {
+        scene.addPointLight(200*hashUnit(i, 5), 200, 200*hashUnit(i, 6), 200, 200, 200, 1);
+    });
+    scene.addCamera(0, 2, 0, 0);
+    double nsKind[4] = {0, 0, 0, 0};
+    double nsMesh = 0;
+    double buildSeconds = 0;
+    Clock::time_point start = Clock::now();
+    if (opt.threads == 0) {
+        for (int kind = 0; kind < 4; kind++) {
+            long n = opt.prims/4 + (kind < opt.prims % 4);
+            nsKind[kind] = timeAdds(n, [&](long j) {
+                addPrimitive(scene, j*4 + kind);
+            });
+        }
+        nsMesh = timeAdds(opt.meshes, [&](long i) {
+            addMeshAt(scene, opt.meshPath, i);
+        });
+    }
+    else {
+        // One region per 100 blocks of primitives, each with its share of meshes
+        size_t numRegions = (size_t)max(1L, opt.prims/40000);
+        buildInParallel(scene, numRegions, [&](Scene3D& region, size_t r) {
+            for (long i = (long)(opt.prims*r/numRegions); i < (long)(opt.prims*(r+1)/numRegions); i++) {
+                addPrimitive(region, i);
+            }
+            for (long i = (long)(opt.meshes*r/numRegions); i < (long)(opt.meshes*(r+1)/numRegions); i++) {
+                addMeshAt(region, opt.meshPath, i);
+            }
+        }, opt.threads);
+    }
+    buildSeconds = secondsSince(start);
+    double rssBuild = getPeakRSS();
+
+    double nsQuery = 0;
+    size_t queryHits = 0;
+    if (opt.index && opt.queries > 0) {
+        vector<ObjectRef> found;
+        start = Clock::now();
+        for (long q = 0; q < opt.queries; q++) {
+            double x = 2000*hashUnit(q, 7), z = 20*(opt.prims/400 + 1)*hashUnit(q, 8);
+            scene.queryRadius(x, 5, z, 10, found);
+            queryHits += found.size();
+        }
+        nsQuery = secondsSince(start)*1e9/opt.queries;
+    }
+
+    start = Clock::now();
+    bool saved = true;
+    if (opt.stream) {
+        scene.finishStreaming();
+    }
+    else if (opt.variants > 0) {
+        // The variants go next to where the scene would have been saved
+        vector<SceneVariant> variants;
+        for (long v = 0; v < opt.variants; v++) {
+            variants.push_back(makeVariant(scene, v, opt.variants));
+        }
+        size_t slash = opt.out.find_last_of("/\\");
+        saved = scene.saveVariants(slash == string::npos ? "" : opt.out.substr(0, slash), variants, opt.threads);
+    }
+    else {
+        saved = scene.saveScene(opt.out, "Benchmark");
+    }
+    double saveSeconds = secondsSince(start);
+    double rssSave = getPeakRSS();
+    if (!saved) {
+        fprintf(stderr, "Could not save the scene\n");
+        return 1;
+    }
+
+    SceneStats stats = scene.getStats();
+    double bytes = 0;
+    if (opt.variants > 0) {
+        for (int c = 0; c < NUM_BYTE_CATEGORIES; c++) {
+            bytes += stats.bytes[c];
+        }
+    }
+    else {
+        bytes = getFileSize(opt.out) + getFileSize(Scene3D::getSidecarPath(opt.out))
+              + getFileSize(Scene3D::getMergedPath(opt.out)) + getDirectorySize(Scene3D::getChunkDirectory(opt.out));
+    }
+    size_t numObjects = 0;
+    for (int kind = 0; kind < NUM_OBJECT_KINDS; kind++) {
+        numObjects += scene.getNumObjects((ObjectKind)kind);
+    }
+    printf("{\n");
+    printf("  \"options\": {\"prims\": %ld, \"meshes\": %ld, \"lights\": %ld, \"mode\": \"%s\", \"instancing\": %s, \"merge\": %s, \"meshCache\": %s, \"index\": %s, \"threads\": %u, \"stream\": %s, \"culling\": %s, \"variants\": %ld},\n",
+           opt.prims, opt.meshes, opt.lights, opt.mode.c_str(), opt.instancing ? "true" : "false",
+           opt.merge ? "true" : "false", opt.meshCache ? "true" : "false", opt.index ? "true" : "false", opt.threads,
+           opt.stream ? "true" : "false", opt.culling ? "true" : "false", opt.variants);
+    printf("  \"compiler\": \"%s\",\n", __VERSION__);
+    printf("  \"binaryVersion\": %d,\n", BINARY_VERSION);
+    printf("  \"objects\": %lu,\n", (unsigned long)numObjects);
+    printf("  \"materials\": %lu,\n", (unsigned long)scene.getNumMaterials());
+    printf("  \"drawCalls\": %.0f,\n", stats.drawCalls);
+    printf("  \"triangles\": %.0f,\n", stats.triangles);
+    printf("  \"withinBudget\": %s,\n", scene.isWithinBudget() ? "true" : "false");
+    if (opt.threads == 0) {
+        printf("  \"nsPerAdd\": {\"box\": %.1f, \"cylinder\": %.1f, \"cone\": %.1f, \"ellipsoid\": %.1f, \"mesh\": %.1f, \"pointLight\": %.1f},\n",
+               nsKind[KIND_BOX], nsKind[KIND_CYLINDER], nsKind[KIND_CONE], nsKind[KIND_ELLIPSOID], nsMesh, nsLight);
+    }
+    printf("  \"buildSeconds\": %.4f,\n", buildSeconds);
+    printf("  \"nsPerObject\": %.1f,\n", numObjects > 0 ? buildSeconds*1e9/numObjects : 0);
+    if (opt.index) {
+        printf("  \"nsPerQuery\": %.1f,\n", nsQuery);
+        printf("  \"queryHits\": %lu,\n", (unsigned long)queryHits);
+    }
+    printf("  \"saveSeconds\": %.4f,\n", saveSeconds);
+    printf("  \"outputBytes\": %.0f,\n", bytes);
+    printf("  \"saveMBPerSecond\": %.2f,\n", saveSeconds > 0 ? bytes/1e6/saveSeconds : 0);
+    printf("  \"peakRSSBytes\": {\"start\": %.0f, \"afterBuild\": %.0f, \"afterSave\": %.0f}\n", rssStart, rssBuild, rssSave);
+    printf("}\n");
+    return scene.isWithinBudget() ? 0 : 1;
+}
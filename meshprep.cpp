@@ -0,0 +1,408 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <algorithm>
+#ifndef _WIN32
+#include <dirent.h>
+#endif
+#include "ObjMesh.h"
+
+/**
+ * Prepares meshes for scenes: reads OFF and OBJ files, centers them and
+ * scales them to unit size, computes vertex normals, and writes them out
+ * as OBJ files laid out like the ones in meshes/, or as binary mesh
+ * caches.  Files are spread over a pool of threads, outputs that are
+ * newer than their inputs are skipped, and a line is printed for each
+ * file with how fast it went.  Run with --help for the options
+ */
+
+struct Options {
+    string format;
+    string outDir;
+    unsigned threads;
+    bool normalize;
+    bool force;
+    vector<string> inputs;
+};
+
+/**
+ * One input file and where it goes
+ */
+struct Job {
+    string input;
+    string output;
+    string name; // File name without the directory or extension
+    double bytes;
+};
+
+/**
+ * What happened to a job
+ */
+struct Result {
+    enum Status {WRITTEN, UP_TO_DATE, FAILED};
+    Status status;
+    size_t numVertices;
+    size_t numTriangles;
+    double seconds;
+};
+
+typedef chrono::steady_clock Clock;
+
+double secondsSince(Clock::time_point start) {
+    return chrono::duration<double>(Clock::now() - start).count();
+}
+
+/**
+ * Runs a fixed set of tasks on a pool of threads.  The tasks are dealt
+ * out to one queue per thread up front.  Each thread works from the front
+ * of its own queue and, once that's empty, steals from the back of the
+ * others', so the threads that drew small files end up helping the ones
+ * that drew big ones instead of sitting idle
+ */
+class WorkStealingPool {
+    private:
+        struct Queue {
+            mutex lock;
+            deque<size_t> tasks;
+        };
+        vector<Queue> queues;
+
+        bool pop(size_t q, size_t& task) {
+            lock_guard<mutex> guard(queues[q].lock);
+            if (queues[q].tasks.empty()) {
+                return false;
+            }
+            task = queues[q].tasks.front();
+            queues[q].tasks.pop_front();
+            return true;
+        }
+
+        bool steal(size_t q, size_t& task) {
+            for (size_t i = 1; i < queues.size(); i++) {
+                Queue& victim = queues[(q + i) % queues.size()];
+                lock_guard<mutex> guard(victim.lock);
+                if (!victim.tasks.empty()) {
+                    task = victim.tasks.back();
+                    victim.tasks.pop_back();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+    public:
+        /**
+         * @param numThreads Number of threads, or 0 to use one per core
+         */
+        WorkStealingPool(unsigned numThreads = 0) {
+            if (numThreads == 0) {
+                numThreads = thread::hardware_concurrency();
+            }
+            if (numThreads == 0) {
+                numThreads = 1;
+            }
+            queues = vector<Queue>(numThreads);
+        }
+
+        size_t getNumThreads() const {
+            return queues.size();
+        }
+
+        /**
+         * Run f(i) for every task i from 0 to numTasks - 1, and wait for
+         * all of them to finish.  Tasks are dealt out in order, so putting
+         * the biggest ones first spreads the work most evenly
+         */
+        template <typename F>
+        void run(size_t numTasks, F f) {
+            for (size_t i = 0; i < numTasks; i++) {
+                queues[i % queues.size()].tasks.push_back(i);
+            }
+            // No tasks are added once the threads start, so a thread can
+            // stop as soon as its own queue and everyone else's are empty
+            auto work = [&](size_t q) {
+                size_t task;
+                while (pop(q, task) || steal(q, task)) {
+                    f(task);
+                }
+            };
+            vector<thread> threads;
+            for (size_t q = 1; q < queues.size() && q < numTasks; q++) {
+                threads.push_back(thread(work, q));
+            }
+            work(0);
+            for (size_t t = 0; t < threads.size(); t++) {
+                threads[t].join();
+            }
+        }
+};
+
+/**
+ * Return the extension of a path in lower case, including the dot, or an
+ * empty string if it has none
+ */
+string getExtension(const string& path) {
+    size_t dot = path.find_last_of('.');
+    size_t slash = path.find_last_of("/\\");
+    if (dot == string::npos || (slash != string::npos && dot < slash)) {
+        return "";
+    }
+    string ext = path.substr(dot);
+    for (size_t i = 0; i < ext.size(); i++) {
+        if (ext[i] >= 'A' && ext[i] <= 'Z') {
+            ext[i] += 'a' - 'A';
+        }
+    }
+    return ext;
+}
+
+bool isMeshFile(const string& path) {
+    string ext = getExtension(path);
+    return ext == ".off" || ext == ".obj";
+}
+
+/**
+ * Add the OFF and OBJ files in a directory to a list, in sorted order
+ * @return False if the directory couldn't be read
+ */
+bool listMeshFiles(const string& dirPath, vector<string>& out) {
+#ifndef _WIN32
+    DIR* dir = opendir(dirPath.c_str());
+    if (dir == NULL) {
+        return false;
+    }
+    vector<string> found;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        string name = entry->d_name;
+        if (name[0] != '.' && isMeshFile(name)) {
+            found.push_back(dirPath + "/" + name);
+        }
+    }
+    closedir(dir);
+    sort(found.begin(), found.end());
+    out.insert(out.end(), found.begin(), found.end());
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool isDirectory(const string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+void printUsage() {
+    printf("Usage: meshprep [options] FILE|DIR...\n");
+    printf("Reads OFF and OBJ files (every one in a directory, for directories) and writes\n");
+    printf("each one out with vertex normals, next to the input or in --out\n");
+    printf("  --format=FORMAT  obj, or s3dm for binary mesh caches (default obj)\n");
+    printf("  --out=DIR        Directory to write to (default: the input's directory)\n");
+    printf("  --threads=N      Number of threads, or 0 to use one per core (default 0)\n");
+    printf("  --normalize=0|1  Center each mesh and scale it to a mean squared radius of 1 (default 1)\n");
+    printf("  --force          Rewrite outputs even if they're newer than their inputs\n");
+}
+
+bool parseOptions(int argc, char** argv, Options& opt) {
+    opt.format = "obj";
+    opt.threads = 0;
+    opt.normalize = true;
+    opt.force = false;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.compare(0, 2, "--") != 0) {
+            opt.inputs.push_back(arg);
+            continue;
+        }
+        size_t eq = arg.find('=');
+        string key = arg.substr(0, eq);
+        string value = eq == string::npos ? "" : arg.substr(eq + 1);
+        if (key == "--format") opt.format = value;
+        else if (key == "--out") opt.outDir = value;
+        else if (key == "--threads") opt.threads = (unsigned)atoi(value.c_str());
+        else if (key == "--normalize") opt.normalize = atoi(value.c_str()) != 0;
+        else if (key == "--force") opt.force = true;
+        else {
+            printUsage();
+            return false;
+        }
+    }
+    if ((opt.format != "obj" && opt.format != "s3dm") || opt.inputs.empty()) {
+        printUsage();
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Work out where each input goes.  Inputs that would overwrite themselves
+ * (an OBJ written as OBJ into its own directory) are left out, as are
+ * inputs whose output another input already claimed, which is how an OFF
+ * file wins over the OBJ that was made from it when a directory holds both
+ * @return False if an input couldn't be found
+ */
+bool makeJobs(const Options& opt, vector<Job>& jobs) {
+    vector<string> paths;
+    for (size_t i = 0; i < opt.inputs.size(); i++) {
+        if (isDirectory(opt.inputs[i])) {
+            if (!listMeshFiles(opt.inputs[i], paths)) {
+                fprintf(stderr, "Couldn't read directory %s\n", opt.inputs[i].c_str());
+                return false;
+            }
+        }
+        else {
+            paths.push_back(opt.inputs[i]);
+        }
+    }
+    // OFF files go first so that they claim their outputs
+    stable_sort(paths.begin(), paths.end(), [](const string& a, const string& b) {
+        return getExtension(a) == ".off" && getExtension(b) != ".off";
+    });
+    unordered_map<string, string> claimed;
+    for (size_t i = 0; i < paths.size(); i++) {
+        Job job;
+        job.input = paths[i];
+        size_t slash = job.input.find_last_of("/\\");
+        string dir = slash == string::npos ? "" : job.input.substr(0, slash + 1);
+        string file = slash == string::npos ? job.input : job.input.substr(slash + 1);
+        job.name = file.substr(0, file.size() - getExtension(file).size());
+        if (!opt.outDir.empty()) {
+            dir = opt.outDir + "/";
+        }
+        job.output = dir + job.name + "." + opt.format;
+        SourceStamp stamp;
+        if (!getFileStamp(job.input, stamp)) {
+            fprintf(stderr, "Couldn't find %s\n", job.input.c_str());
+            return false;
+        }
+        job.bytes = (double)stamp.size;
+        if (!isMeshFile(job.input)) {
+            fprintf(stderr, "Skipping %s: not an OFF or OBJ file\n", job.input.c_str());
+        }
+        else if (claimed.count(job.output) > 0) {
+            fprintf(stderr, "Skipping %s: %s already comes from %s\n", job.input.c_str(), job.output.c_str(), claimed[job.output].c_str());
+        }
+        else if (job.output == job.input) {
+            fprintf(stderr, "Skipping %s: it would be overwritten by its own output (use --out)\n", job.input.c_str());
+        }
+        else {
+            claimed[job.output] = job.input;
+            jobs.push_back(job);
+        }
+    }
+    return true;
+}
+
+/**
+ * Return true if a job's output is newer than its input.  Binary caches
+ * record the input they were made from, so they're checked the same way
+ * scenes check them
+ */
+bool isUpToDate(const Options& opt, const Job& job) {
+    SourceStamp src, dst;
+    if (!getFileStamp(job.input, src) || !getFileStamp(job.output, dst)) {
+        return false;
+    }
+    if (opt.format == "s3dm") {
+        float lo[3], hi[3];
+        return isMeshCacheFresh(job.input, job.output, src, lo, hi);
+    }
+    return dst.size > 0 && dst.mtime >= src.mtime;
+}
+
+Result runJob(const Options& opt, const Job& job) {
+    Result result;
+    result.numVertices = 0;
+    result.numTriangles = 0;
+    Clock::time_point start = Clock::now();
+    if (!opt.force && isUpToDate(opt, job)) {
+        result.status = Result::UP_TO_DATE;
+        result.seconds = secondsSince(start);
+        return result;
+    }
+    ObjMesh mesh;
+    SourceStamp stamp;
+    bool ok;
+    if (getExtension(job.input) == ".off") {
+        ok = readOff(job.input, mesh, &stamp);
+    }
+    else {
+        ok = readObj(job.input, mesh, &stamp);
+    }
+    if (ok) {
+        if (opt.normalize) {
+            normalizeMesh(mesh);
+        }
+        if (opt.format == "s3dm") {
+            ok = writeMeshCache(job.output, mesh, stamp);
+        }
+        else {
+            ok = writeObj(job.output, mesh, job.name);
+        }
+    }
+    result.status = ok ? Result::WRITTEN : Result::FAILED;
+    result.numVertices = mesh.numVertices();
+    result.numTriangles = mesh.numTriangles();
+    result.seconds = secondsSince(start);
+    return result;
+}
+
+int main(int argc, char** argv) {
+    Options opt;
+    if (!parseOptions(argc, argv, opt)) {
+        return 1;
+    }
+    vector<Job> jobs;
+    if (!makeJobs(opt, jobs)) {
+        return 1;
+    }
+#ifndef _WIN32
+    if (!opt.outDir.empty() && !isDirectory(opt.outDir) && mkdir(opt.outDir.c_str(), 0777) != 0) {
+        fprintf(stderr, "Couldn't make directory %s\n", opt.outDir.c_str());
+        return 1;
+    }
+#endif
+    // Start on the biggest files so that the small ones fill in the gaps
+    stable_sort(jobs.begin(), jobs.end(), [](const Job& a, const Job& b) {
+        return a.bytes > b.bytes;
+    });
+    vector<Result> results(jobs.size());
+    mutex printLock;
+    WorkStealingPool pool(opt.threads);
+    Clock::time_point start = Clock::now();
+    pool.run(jobs.size(), [&](size_t i) {
+        Result r = runJob(opt, jobs[i]);
+        results[i] = r;
+        lock_guard<mutex> guard(printLock);
+        if (r.status == Result::UP_TO_DATE) {
+            printf("%s: up to date\n", jobs[i].output.c_str());
+        }
+        else if (r.status == Result::FAILED) {
+            printf("%s: FAILED to make %s\n", jobs[i].input.c_str(), jobs[i].output.c_str());
+        }
+        else {
+            printf("%s -> %s: %lu vertices, %lu triangles, %.1f ms, %.1f MB/s\n",
+                   jobs[i].input.c_str(), jobs[i].output.c_str(), (unsigned long)r.numVertices,
+                   (unsigned long)r.numTriangles, r.seconds*1e3, r.seconds > 0 ? jobs[i].bytes/1e6/r.seconds : 0);
+        }
+        fflush(stdout);
+    });
+    double seconds = secondsSince(start);
+    size_t counts[3] = {0, 0, 0};
+    double bytes = 0;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        counts[results[i].status]++;
+        if (results[i].status == Result::WRITTEN) {
+            bytes += jobs[i].bytes;
+        }
+    }
+    printf("%lu written, %lu up to date, %lu failed in %.3f s on %lu threads (%.1f MB/s)\n",
+           (unsigned long)counts[Result::WRITTEN], (unsigned long)counts[Result::UP_TO_DATE],
+           (unsigned long)counts[Result::FAILED], seconds, (unsigned long)pool.getNumThreads(),
+           seconds > 0 ? bytes/1e6/seconds : 0);
+    return counts[Result::FAILED] > 0 ? 1 : 0;
+}
@@ -1,10 +1,23 @@
 const RADIAL_SEGMENTS = 32; // For spheres, cylinders, and cones
 const BEACON_SIZE = 0.1; // For point lights
+const CHUNK_UNLOAD_FACTOR = 1.5; // Chunks are dropped this many load radii away
+const CHUNK_MAX_LOADS = 4; // Most chunks to fetch at the same time
+const LOD_UPDATE_FRACTION = 0.125; // Instanced levels of detail are updated when the camera moves this fraction of the first switch distance
+const VISIBILITY_TOLERANCE = 1e-6; // Precomputed visibility is used while a camera is this close to where it was placed
 
 function getMaterialPrefix(r, g, b, roughness, metalness) {
     return r + "_" + g + "_" + b + "_" + roughness + "_" + metalness;
 }
 
+/**
+ * Return getMaterialPrefix of a material with every parameter rounded to
+ * 6 significant digits, which is how Scene3D writes them out as text
+ */
+function getRoundedMaterialPrefix(r, g, b, roughness, metalness) {
+    const round = x => Number(x.toPrecision(6));
+    return getMaterialPrefix(round(r), round(g), round(b), round(roughness), round(metalness));
+}
+
 /**
  * Convert a hex color string to an array of floating point numbers in [0, 1]
  * 
@@ -40,12 +53,106 @@ function setObjectScale(obj, sx, sy, sz) {
     obj.scale.z = sz;
 }
 
+/**
+ * Compute the matrix of an object with a particular position, rotation
+ * and scale, using the same conventions as setObjectPosRot and setObjectScale
+ * 
+ * @param {THREE.Matrix4} m Matrix to fill in
+ * @param {array} t Array of transforms, 9 per object (x, y, z, rx, ry, rz, sx, sy, sz)
+ * @param {int} i Index of the object in t
+ */
+function setInstanceMatrix(m, t, i) {
+    let q = glMatrix.quat.create();
+    glMatrix.quat.fromEuler(q, t[i*9+3], t[i*9+4], t[i*9+5]);
+    const pos = new THREE.Vector3(t[i*9], t[i*9+1], t[i*9+2]);
+    const rot = new THREE.Quaternion(q[0], q[1], q[2], q[3]);
+    const scale = new THREE.Vector3(t[i*9+6], t[i*9+7], t[i*9+8]);
+    m.compose(pos, rot, scale);
+}
+
+/**
+ * Turn a binary mesh cache written by ObjMesh.h into an object that can
+ * be placed in the scene.  The file has a 64 byte header followed by
+ * float32 positions, float32 normals and uint32 indices
+ * 
+ * @param {ArrayBuffer} buffer Contents of the file
+ * @returns {THREE.Group} A group holding a single mesh
+ */
+function parseBinaryMesh(buffer) {
+    const header = new DataView(buffer, 0, 64);
+    const nv = header.getUint32(32, true);
+    const nt = header.getUint32(36, true);
+    const geometry = new THREE.BufferGeometry();
+    geometry.setAttribute("position", new THREE.BufferAttribute(new Float32Array(buffer, 64, nv*3), 3));
+    geometry.setAttribute("normal", new THREE.BufferAttribute(new Float32Array(buffer, 64 + nv*12, nv*3), 3));
+    geometry.setIndex(new THREE.BufferAttribute(new Uint32Array(buffer, 64 + nv*24, nt*3), 1));
+    const group = new THREE.Group();
+    group.add(new THREE.Mesh(geometry));
+    return group;
+}
+
+const BINARY_KINDS = ["box", "cylinder", "cone", "ellipsoid", "mesh"];
+
+/**
+ * Decode one column of a batch in a binary scene written by Scene3D,
+ * storing it in every 9th entry of a transforms array
+ * 
+ * @param {ArrayBuffer} buffer The binary scene
+ * @param {DataView} view A view of the whole buffer
+ * @param {int} offset Byte offset of the column
+ * @param {array} transforms Transforms of the batch, 9 per instance
+ * @param {int} k Which of the 9 components this column holds
+ * @param {int} count Number of instances in the batch
+ * @returns {int} Byte offset just past the column
+ */
+function decodeBinaryColumn(buffer, view, offset, transforms, k, count) {
+    const type = view.getUint8(offset);
+    const p = Math.pow(10, view.getUint8(offset+1));
+    offset += 4;
+    if (type == 0) {
+        const x = view.getFloat64(offset, true);
+        for (let i = 0; i < count; i++) {
+            transforms[i*9+k] = x;
+        }
+        return offset + 8;
+    }
+    let values = null;
+    if (type == 1) {
+        values = new Int8Array(buffer, offset, count);
+    }
+    else if (type == 2) {
+        values = new Int16Array(buffer, offset, count);
+    }
+    else if (type == 3) {
+        values = new Int32Array(buffer, offset, count);
+    }
+    else {
+        values = new Float32Array(buffer, offset, count);
+    }
+    for (let i = 0; i < count; i++) {
+        transforms[i*9+k] = values[i]/p;
+    }
+    return offset + Math.ceil(values.byteLength/4)*4;
+}
+
 class SceneCanvas {
     constructor(winFac) {
         if (winFac === undefined) {
             winFac = 0.8;
         }
         this.materials = {};
+        this.materialReplacements = null;
+        this.unitGeometries = {};
+        this.meshAssets = [];
+        this.lodBatches = [];
+        this.chunks = [];
+        this.chunkLoads = 0;
+        this.chunkRadius = 0;
+        this.lastChunkPos = null;
+        this.numObjectIds = 0;
+        this.visibilityEntries = [];
+        this.visibleRuns = null;
+        this.visibleMask = null;
         const renderer = new THREE.WebGLRenderer({antialias:true});
         let W = Math.round(window.innerWidth*winFac);
         let H = Math.round(window.innerHeight*winFac);
@@ -629,6 +736,31 @@ class SceneCanvas {
         this.addLightToMenu(light, x, y, z, r, g, b);
     }
 
+    /**
+     * Draw everything that has one material with another instead.  This
+     * has to be called before anything with the material is added.
+     * Materials are matched to 6 significant digits, which is how they
+     * are written out, so that materials from binary scenes match too
+     * 
+     * @param r Red component of the material to replace, in [0, 255]
+     * @param g Green component of the material to replace, in [0, 255]
+     * @param b Blue component of the material to replace, in [0, 255]
+     * @param roughness Roughness of the material to replace
+     * @param metalness Metalness of the material to replace
+     * @param r2 Red component of the material to draw with instead
+     * @param g2 Green component of the material to draw with instead
+     * @param b2 Blue component of the material to draw with instead
+     * @param roughness2 Roughness of the material to draw with instead
+     * @param metalness2 Metalness of the material to draw with instead
+     */
+    replaceMaterial(r, g, b, roughness, metalness, r2, g2, b2, roughness2, metalness2) {
+        if (this.materialReplacements === null) {
+            this.materialReplacements = {};
+        }
+        const key = getRoundedMaterialPrefix(r, g, b, roughness, metalness);
+        this.materialReplacements[key] = [r2, g2, b2, roughness2, metalness2];
+    }
+
     /**
      * Create and cache a new material object, or return the pre-cached
      * material object if there's already a match for these parameters
@@ -641,6 +773,12 @@ class SceneCanvas {
      * @returns 
      */
     addMaterial(r, g, b, roughness, metalness) {
+        if (!(this.materialReplacements === null)) {
+            const key = getRoundedMaterialPrefix(r, g, b, roughness, metalness);
+            if (key in this.materialReplacements) {
+                [r, g, b, roughness, metalness] = this.materialReplacements[key];
+            }
+        }
         const prefix = getMaterialPrefix(r, g, b, roughness, metalness);
         if (!(prefix in this.materials)) {
             let params = {};
@@ -708,6 +846,7 @@ class SceneCanvas {
         const box = new THREE.Mesh(geometry, material);
         setObjectPosRot(box, cx, cy, cz, rx, ry, rz);
         this.scene.add(box);
+        this.addVisibilityEntry(this.reserveObjectIds(1), 1, [box], null);
         return box;
     }
 
@@ -755,6 +894,7 @@ class SceneCanvas {
         setObjectPosRot(cylinder, cx, cy, cz, rx, ry, rz);
         setObjectScale(cylinder, sx, sy, sz);
         this.scene.add(cylinder);
+        this.addVisibilityEntry(this.reserveObjectIds(1), 1, [cylinder], null);
     }
 
     /**
@@ -801,6 +941,7 @@ class SceneCanvas {
         setObjectPosRot(cone, cx, cy, cz, rx, ry, rz);
         setObjectScale(cone, sx, sy, sz);
         this.scene.add(cone);
+        this.addVisibilityEntry(this.reserveObjectIds(1), 1, [cone], null);
     }
 
     /**
@@ -836,10 +977,217 @@ class SceneCanvas {
         setObjectPosRot(sphere, cx, cy, cz, rx, ry, rz);
         setObjectScale(sphere, radx, rady, radz);
         this.scene.add(sphere);
+        this.addVisibilityEntry(this.reserveObjectIds(1), 1, [sphere], null);
         this.obj = sphere;
         return sphere;
     }
 
+    /**
+     * Declare a mesh that can be placed in the scene any number of times.
+     * The file is only fetched and parsed once, the first time it is placed
+     * 
+     * @param path File path to mesh, relative to this directory
+     * @returns Index of the asset
+     */
+    addMeshAsset(path) {
+        this.meshAssets.push({"path":path, "matpath":null, "loading":null, "shinyMaterials":{}});
+        return this.meshAssets.length - 1;
+    }
+
+    /**
+     * Declare a mesh stored in the binary cache format written by ObjMesh.h
+     * that can be placed in the scene any number of times
+     * 
+     * @param path File path to the binary mesh, relative to this directory
+     * @returns Index of the asset
+     */
+    addBinaryMeshAsset(path) {
+        this.meshAssets.push({"path":path, "matpath":null, "binary":true, "loading":null, "shinyMaterials":{}});
+        return this.meshAssets.length - 1;
+    }
+
+    /**
+     * Declare a textured mesh that can be placed in the scene any number of
+     * times.  The mesh and its material are only fetched and parsed once
+     * 
+     * @param path File path to mesh, relative to this directory
+     * @param matpath File path to material, relative to this directory
+     * @returns Index of the asset
+     */
+    addTexturedMeshAsset(path, matpath) {
+        this.meshAssets.push({"path":path, "matpath":matpath, "loading":null, "shinyMaterials":{}});
+        return this.meshAssets.length - 1;
+    }
+
+    /**
+     * Find the index of a mesh asset, declaring it if it hasn't been seen yet
+     * 
+     * @param path File path to mesh, relative to this directory
+     * @param matpath File path to material, or null for a plain mesh
+     */
+    getMeshAssetIndex(path, matpath) {
+        for (let i = 0; i < this.meshAssets.length; i++) {
+            if (this.meshAssets[i].path == path && this.meshAssets[i].matpath == matpath) {
+                return i;
+            }
+        }
+        if (matpath === null) {
+            return this.addMeshAsset(path);
+        }
+        return this.addTexturedMeshAsset(path, matpath);
+    }
+
+    /**
+     * Give a plain mesh asset simpler versions to draw when it's far from
+     * the camera
+     * 
+     * @param {int} idx Index of the asset
+     * @param {array} paths Paths to the binary meshes of the levels, from most to least detailed
+     * @param {array} distances How far from the camera each level starts to
+     *                          be used, for a copy of the mesh at scale 1
+     */
+    setMeshAssetLods(idx, paths, distances) {
+        const asset = this.meshAssets[idx];
+        asset.lods = [];
+        for (let k = 0; k < paths.length; k++) {
+            asset.lods.push(this.addBinaryMeshAsset(paths[k]));
+        }
+        asset.lodDistances = distances;
+    }
+
+    /**
+     * Start loading a mesh asset and all of its levels of detail
+     * 
+     * @param {int} idx Index of the asset
+     * @returns A promise that resolves to an array of loaded objects, from
+     *          the full mesh to the least detailed level
+     */
+    loadMeshLevels(idx) {
+        const asset = this.meshAssets[idx];
+        const levels = [this.loadMeshAsset(idx)];
+        if (!(asset.lods === undefined)) {
+            for (let k = 0; k < asset.lods.length; k++) {
+                levels.push(this.loadMeshAsset(asset.lods[k]));
+            }
+        }
+        return Promise.all(levels);
+    }
+
+    /**
+     * Start loading a mesh asset if it isn't loading already
+     * 
+     * @param {int} idx Index of the asset
+     * @returns A promise that resolves to the loaded object, which should
+     *          be cloned rather than added to the scene directly
+     */
+    loadMeshAsset(idx) {
+        const asset = this.meshAssets[idx];
+        if (!(asset.loading === null)) {
+            return asset.loading;
+        }
+        const path = asset.path;
+        const matpath = asset.matpath;
+        function progress(file) {
+            return function(xhr) {
+                console.log(file + " " + (xhr.loaded / xhr.total * 100) + "% loaded");
+            };
+        }
+        asset.loading = new Promise(function(resolve, reject) {
+            const manager = new THREE.LoadingManager();
+            const objLoader = new OBJLoader(manager);
+            function loadObj() {
+                objLoader.load(path, resolve, progress(path), function() {
+                    console.error("Error loading " + path);
+                    reject(path);
+                });
+            }
+            if (asset.binary) {
+                fetch(path).then(function(response) {
+                    if (!response.ok) {
+                        throw new Error(response.statusText);
+                    }
+                    return response.arrayBuffer();
+                }).then(function(buffer) {
+                    resolve(parseBinaryMesh(buffer));
+                }).catch(function() {
+                    console.error("Error loading " + path);
+                    reject(path);
+                });
+            }
+            else if (matpath === null) {
+                loadObj();
+            }
+            else {
+                const mtlLoader = new MTLLoader(manager);
+                mtlLoader.load(matpath, (mtl) => {
+                    mtl.preload();
+                    objLoader.setMaterials(mtl);
+                    loadObj();
+                }, progress(matpath), function() {
+                    console.error("Error loading " + matpath);
+                    reject(matpath);
+                });
+            }
+        });
+        return asset.loading;
+    }
+
+    /**
+     * Return a copy of a textured mesh asset's material with a particular
+     * shininess, shared by every placement with that shininess
+     * 
+     * @param {int} idx Index of the asset
+     * @param {THREE.Material} material The material loaded with the asset
+     * @param shininess A number in [0, 255] describing how shiny the mesh is
+     */
+    getShinyMaterial(idx, material, shininess) {
+        const cache = this.meshAssets[idx].shinyMaterials;
+        const key = material.uuid + "_" + shininess;
+        if (!(key in cache)) {
+            cache[key] = material.clone();
+            cache[key].shininess = shininess;
+        }
+        return cache[key];
+    }
+
+    /**
+     * Place a copy of a textured mesh asset in the scene once it has loaded.
+     * Every copy shares the geometry of the asset
+     * 
+     * @param {int} idx Index of the asset
+     * @param cx Offset in x
+     * @param cy Offset in y
+     * @param cz Offset in z
+     * @param rx Rotation around x-axis
+     * @param ry Rotation around y-axis
+     * @param rz Rotation around z-axis
+     * @param sx Scale along x-axis
+     * @param sy Scale along y-axis
+     * @param sz Scale along z-axis
+     * @param shininess A number in [0, 255] describing how shiny the mesh is
+     */
+    addTexturedMeshRef(idx, cx, cy, cz, rx, ry, rz, sx, sy, sz, shininess) {
+        const that = this;
+        const id = this.reserveObjectIds(1);
+        this.loadMeshAsset(idx).then(function(template) {
+            const obj = template.clone();
+            setObjectPosRot(obj, cx, cy, cz, rx, ry, rz);
+            setObjectScale(obj, sx, sy, sz);
+            obj.traverse(function (child) {
+                if (child.isMesh) {
+                    if (Array.isArray(child.material)) {
+                        child.material = child.material.map(m => that.getShinyMaterial(idx, m, shininess));
+                    }
+                    else {
+                        child.material = that.getShinyMaterial(idx, child.material, shininess);
+                    }
+                }
+            });
+            that.scene.add(obj);
+            that.addVisibilityEntry(id, 1, [obj], null);
+        });
+    }
+
     /**
      * Asynchronously load the mesh geometry and the material for the mesh
      * and add them to the scene
@@ -858,32 +1206,56 @@ class SceneCanvas {
      * @param shininess A number in [0, 255] describing how shiny the mesh is
      */
     addTexturedMesh(path, matpath, cx, cy, cz, rx, ry, rz, sx, sy, sz, shininess) {
-        const manager = new THREE.LoadingManager();
+        const idx = this.getMeshAssetIndex(path, matpath);
+        this.addTexturedMeshRef(idx, cx, cy, cz, rx, ry, rz, sx, sy, sz, shininess);
+    }
+
+    /**
+     * Place a copy of a mesh asset in the scene once it has loaded.
+     * Every copy shares the geometry of the asset
+     * 
+     * @param {int} idx Index of the asset
+     * @param cx Offset in x
+     * @param cy Offset in y
+     * @param cz Offset in z
+     * @param rx Rotation around x-axis
+     * @param ry Rotation around y-axis
+     * @param rz Rotation around z-axis
+     * @param sx Scale along x-axis
+     * @param sy Scale along y-axis
+     * @param sz Scale along z-axis
+     * @param r Red component in [0, 255]
+     * @param g Green component in [0, 255]
+     * @param b Blue component in [0, 255]
+     * @param roughness How rough the material appears. 0.0 means a smooth mirror reflection, 1.0 means fully diffuse. https://threejs.org/docs/#api/en/materials/MeshStandardMaterial.roughness
+     * @param metalness How much the material is like a metal. Non-metallic materials such as wood or stone use 0.0, metallic use 1.0, with nothing (usually) in between. https://threejs.org/docs/#api/en/materials/MeshStandardMaterial.metalness
+     */
+    addMeshRef(idx, cx, cy, cz, rx, ry, rz, sx, sy, sz, r, g, b, roughness, metalness) {
         const that = this;
-        const mtlLoader = new MTLLoader(manager);
-        const objLoader = new OBJLoader(manager);
-        mtlLoader.load(matpath, (mtl) => {
-            mtl.preload();
-            objLoader.setMaterials(mtl);
-            console.log(mtl.materials.Default_OBJ);
-            mtl.materials.Default_OBJ.shininess = shininess;
-            objLoader.load(path, function(obj) {       
-                setObjectPosRot(obj, cx, cy, cz, rx, ry, rz);
-                setObjectScale(obj, sx, sy, sz);
-                that.scene.add(obj);
-            },
-            function(xhr){
-                console.log(path + " " + (xhr.loaded / xhr.total * 100) + "% loaded")
-            },
-            function(){
-                console.error("Error loading " + path);
+        const asset = this.meshAssets[idx];
+        const id = this.reserveObjectIds(1);
+        this.loadMeshLevels(idx).then(function(levels) {
+            const material = that.addMaterial(r, g, b, roughness, metalness);
+            let obj = null;
+            if (levels.length == 1) {
+                obj = levels[0].clone();
+            }
+            else {
+                // Switch to simpler levels farther away, accounting for scale
+                obj = new THREE.LOD();
+                const s = Math.max(Math.abs(sx), Math.abs(sy), Math.abs(sz));
+                for (let k = 0; k < levels.length; k++) {
+                    obj.addLevel(levels[k].clone(), k == 0 ? 0 : asset.lodDistances[k-1]*s);
+                }
+            }
+            setObjectPosRot(obj, cx, cy, cz, rx, ry, rz);
+            setObjectScale(obj, sx, sy, sz);
+            obj.traverse( function (child) {
+                child.material = material;
             });
-        },
-        function(xhr){
-            console.log(matpath + " " + (xhr.loaded / xhr.total * 100) + "% loaded")
-        },
-        function(){
-            console.error("Error loading " + matpath);
+            that.scene.add(obj);
+            that.obj = obj;
+            that.addVisibilityEntry(id, 1, [obj], null);
         });
     }
 
@@ -907,26 +1279,578 @@ class SceneCanvas {
      * @param metalness How much the material is like a metal. Non-metallic materials such as wood or stone use 0.0, metallic use 1.0, with nothing (usually) in between. https://threejs.org/docs/#api/en/materials/MeshStandardMaterial.metalness
      */
     addMesh(path, cx, cy, cz, rx, ry, rz, sx, sy, sz, r, g, b, roughness, metalness) {
+        const idx = this.getMeshAssetIndex(path, null);
+        this.addMeshRef(idx, cx, cy, cz, rx, ry, rz, sx, sy, sz, r, g, b, roughness, metalness);
+    }
+
+    /**
+     * Return the geometry shared by all instanced primitives of a kind.
+     * Boxes are 1x1x1, cylinders and cones have radius 1 and height 1,
+     * and ellipsoids are unit spheres
+     * 
+     * @param {string} kind One of "box", "cylinder", "cone", "ellipsoid"
+     */
+    getUnitGeometry(kind) {
+        if (!(kind in this.unitGeometries)) {
+            let geometry = null;
+            if (kind == "box") {
+                geometry = new THREE.BoxGeometry(1, 1, 1);
+            }
+            else if (kind == "cylinder") {
+                geometry = new THREE.CylinderGeometry(1, 1, 1, RADIAL_SEGMENTS);
+            }
+            else if (kind == "cone") {
+                geometry = new THREE.ConeGeometry(1, 1, RADIAL_SEGMENTS);
+            }
+            else {
+                geometry = new THREE.SphereGeometry(1, RADIAL_SEGMENTS, RADIAL_SEGMENTS);
+            }
+            this.unitGeometries[kind] = geometry;
+        }
+        return this.unitGeometries[kind];
+    }
+
+    /**
+     * Draw many copies of a geometry that share a material with a single
+     * instanced mesh
+     * 
+     * @param {THREE.BufferGeometry} geometry Geometry shared by every instance
+     * @param {THREE.Material} material Material shared by every instance
+     * @param {array} transforms Transforms of the instances, 9 per instance (x, y, z, rx, ry, rz, sx, sy, sz)
+     * @param {THREE.Matrix4} local Optional transform to apply before each instance transform
+     * @param {THREE.Object3D} parent Optional object to add the instances to instead of the scene
+     */
+    addInstances(geometry, material, transforms, local, parent) {
+        const N = transforms.length/9;
+        const mesh = new THREE.InstancedMesh(geometry, material, N);
+        const m = new THREE.Matrix4();
+        for (let i = 0; i < N; i++) {
+            setInstanceMatrix(m, transforms, i);
+            if (!(local === undefined)) {
+                m.multiply(local);
+            }
+            mesh.setMatrixAt(i, m);
+        }
+        mesh.instanceMatrix.needsUpdate = true;
+        // The bounding sphere of the geometry does not account for the
+        // instance transforms, so it can't be used for culling
+        mesh.frustumCulled = false;
+        (parent === undefined ? this.scene : parent).add(mesh);
+        return mesh;
+    }
+
+    /**
+     * Add many primitives of the same kind and material to the scene
+     * with a single draw call
+     * 
+     * @param {string} kind One of "box", "cylinder", "cone", "ellipsoid"
+     * @param r Red component in [0, 255]
+     * @param g Green component in [0, 255]
+     * @param b Blue component in [0, 255]
+     * @param roughness How rough the material appears. 0.0 means a smooth mirror reflection, 1.0 means fully diffuse. https://threejs.org/docs/#api/en/materials/MeshStandardMaterial.roughness
+     * @param metalness How much the material is like a metal. Non-metallic materials such as wood or stone use 0.0, metallic use 1.0, with nothing (usually) in between. https://threejs.org/docs/#api/en/materials/MeshStandardMaterial.metalness
+     * @param {array} transforms Transforms of the unit geometry, 9 per primitive (x, y, z, rx, ry, rz, sx, sy, sz)
+     * @param {THREE.Object3D} parent Optional object to add the primitives to instead of the scene
+     * @param {int} firstId Optional id of the first primitive (see reserveObjectIds), or null
+     *                      to leave them out of precomputed visibility
+     */
+    addInstancedPrimitives(kind, r, g, b, roughness, metalness, transforms, parent, firstId) {
+        const geometry = this.getUnitGeometry(kind);
+        const material = this.addMaterial(r, g, b, roughness, metalness);
+        const mesh = this.addInstances(geometry, material, transforms, undefined, parent);
+        if (!(firstId === null)) {
+            this.addVisibilityEntry(this.reserveObjectIds(transforms.length/9, firstId), transforms.length/9, [mesh], null);
+        }
+        return mesh;
+    }
+
+    /**
+     * Add many copies of a mesh asset that share a material to the scene
+     * once it has loaded, with one draw call per part of the mesh
+     * 
+     * @param {int} idx Index of the asset
+     * @param r Red component in [0, 255]
+     * @param g Green component in [0, 255]
+     * @param b Blue component in [0, 255]
+     * @param roughness How rough the material appears. 0.0 means a smooth mirror reflection, 1.0 means fully diffuse. https://threejs.org/docs/#api/en/materials/MeshStandardMaterial.roughness
+     * @param metalness How much the material is like a metal. Non-metallic materials such as wood or stone use 0.0, metallic use 1.0, with nothing (usually) in between. https://threejs.org/docs/#api/en/materials/MeshStandardMaterial.metalness
+     * @param {array} transforms Transforms of the mesh, 9 per copy (x, y, z, rx, ry, rz, sx, sy, sz)
+     * @param {THREE.Object3D} parent Optional object to add the copies to instead of the scene
+     * @param {int} firstId Optional id of the first copy (see reserveObjectIds), or null
+     *                      to leave them out of precomputed visibility
+     */
+    addInstancedMesh(idx, r, g, b, roughness, metalness, transforms, parent, firstId) {
         const that = this;
-        const objLoader = new OBJLoader();
-        objLoader.load(path, function(obj) {       
-            setObjectPosRot(obj, cx, cy, cz, rx, ry, rz);
-            setObjectScale(obj, sx, sy, sz);
+        const asset = this.meshAssets[idx];
+        if (!(firstId === null)) {
+            firstId = this.reserveObjectIds(transforms.length/9, firstId);
+        }
+        this.loadMeshLevels(idx).then(function(levels) {
+            if (!(parent === undefined) && parent.unloaded) {
+                // The chunk was unloaded before the mesh finished loading
+                return;
+            }
             const material = that.addMaterial(r, g, b, roughness, metalness);
-            obj.traverse( function (child) {
-                child.material = material;
+            const batch = {transforms:transforms, distances:asset.lodDistances, levels:[], parent:parent, lastPos:null, hidden:null};
+            for (let k = 0; k < levels.length; k++) {
+                const meshes = [];
+                levels[k].updateMatrixWorld(true);
+                levels[k].traverse(function (child) {
+                    if (child.isMesh) {
+                        meshes.push(that.addInstances(child.geometry, material, transforms, child.matrixWorld, parent));
+                    }
+                });
+                batch.levels.push(meshes);
+            }
+            if (levels.length > 1) {
+                // Every level starts out with all of the copies; keep their
+                // matrices so that each copy can be moved between levels
+                let minScale = Infinity;
+                for (let i = 0; i < transforms.length; i += 9) {
+                    minScale = Math.min(minScale, Math.max(Math.abs(transforms[i+6]), Math.abs(transforms[i+7]), Math.abs(transforms[i+8])));
+                }
+                batch.step = LOD_UPDATE_FRACTION*batch.distances[0]*minScale;
+                batch.levels.forEach(function(meshes) {
+                    meshes.forEach(function(mesh) {
+                        mesh.allMatrices = mesh.instanceMatrix.array.slice();
+                    });
+                });
+                that.lodBatches.push(batch);
+                that.updateLodBatch(batch);
+            }
+            if (!(firstId === null)) {
+                that.addVisibilityEntry(firstId, transforms.length/9, levels.length > 1 ? [] : batch.levels[0], levels.length > 1 ? batch : null);
+            }
+        });
+    }
+
+    /**
+     * Move each copy in an instanced batch of a mesh with levels of detail
+     * to the level that matches its distance from the camera
+     * 
+     * @param {object} batch The batch, as made by addInstancedMesh
+     */
+    updateLodBatch(batch) {
+        if (this.camera === null) {
+            return;
+        }
+        const pos = this.camera.pos;
+        if (!(batch.lastPos === null) && glMatrix.vec3.distance(pos, batch.lastPos) < batch.step) {
+            return;
+        }
+        batch.lastPos = glMatrix.vec3.clone(pos);
+        const t = batch.transforms;
+        const counts = batch.levels.map(function() { return 0; });
+        for (let i = 0; i < t.length/9; i++) {
+            if (!(batch.hidden === null) && batch.hidden[i]) {
+                continue;
+            }
+            const dx = t[i*9] - pos[0], dy = t[i*9+1] - pos[1], dz = t[i*9+2] - pos[2];
+            const d = Math.sqrt(dx*dx + dy*dy + dz*dz)/Math.max(Math.abs(t[i*9+6]), Math.abs(t[i*9+7]), Math.abs(t[i*9+8]));
+            let k = 0;
+            while (k < batch.distances.length && d >= batch.distances[k]) {
+                k++;
+            }
+            const meshes = batch.levels[k];
+            for (let j = 0; j < meshes.length; j++) {
+                meshes[j].instanceMatrix.array.set(meshes[j].allMatrices.subarray(i*16, i*16+16), counts[k]*16);
+            }
+            counts[k]++;
+        }
+        for (let k = 0; k < batch.levels.length; k++) {
+            batch.levels[k].forEach(function(mesh) {
+                mesh.count = counts[k];
+                mesh.visible = counts[k] > 0;
+                mesh.instanceMatrix.needsUpdate = true;
             });
-            that.scene.add(obj);
-            that.obj = obj;
-        },
-        function(xhr){
-            console.log(path + " " + (xhr.loaded / xhr.total * 100) + "% loaded")
-        },
-        function(){
-            console.error("Error loading " + path);
+        }
+    }
+
+    /**
+     * Add all of the primitives and meshes in a binary scene written by
+     * Scene3D, with one instanced mesh per batch
+     * 
+     * @param {ArrayBuffer} buffer The binary scene
+     * @param {THREE.Object3D} parent Optional object to add everything to instead of the scene
+     * @param {int} firstId Optional id of the first object (see reserveObjectIds).  If
+     *                      it isn't given, the objects are left out of precomputed visibility
+     * @returns {array} The batches, each with a kind, mesh asset, material
+     *                  index and transforms
+     */
+    decodeBinaryScene(buffer, parent, firstId) {
+        const view = new DataView(buffer);
+        const numMaterials = view.getUint32(8, true);
+        const numBatches = view.getUint32(12, true);
+        let offset = 16;
+        const materials = [];
+        for (let i = 0; i < numMaterials; i++) {
+            let m = [];
+            for (let k = 0; k < 5; k++) {
+                m.push(view.getFloat64(offset, true));
+                offset += 8;
+            }
+            materials.push(m);
+        }
+        const batches = [];
+        for (let b = 0; b < numBatches; b++) {
+            const batch = {};
+            batch.kind = BINARY_KINDS[view.getUint32(offset, true)];
+            batch.asset = view.getUint32(offset+4, true);
+            batch.material = view.getUint32(offset+8, true);
+            const count = view.getUint32(offset+12, true);
+            offset += 16;
+            batch.transforms = new Float64Array(count*9);
+            for (let k = 0; k < 9; k++) {
+                offset = decodeBinaryColumn(buffer, view, offset, batch.transforms, k, count);
+            }
+            const m = materials[batch.material];
+            const id = firstId === undefined ? null : firstId;
+            if (batch.kind == "mesh") {
+                this.addInstancedMesh(batch.asset, m[0], m[1], m[2], m[3], m[4], batch.transforms, parent, id);
+            }
+            else {
+                this.addInstancedPrimitives(batch.kind, m[0], m[1], m[2], m[3], m[4], batch.transforms, parent, id);
+            }
+            if (!(firstId === undefined)) {
+                firstId += count;
+            }
+            batches.push(batch);
+        }
+        return batches;
+    }
+
+    /**
+     * Fetch a binary scene written by Scene3D and add everything in it
+     * 
+     * @param {string} url Path to the binary file, or a base64 data URL
+     * @param {int} firstId Optional id of the first object, for precomputed visibility
+     */
+    loadBinaryScene(url, firstId) {
+        const that = this;
+        return fetch(url).then(function(response) {
+            if (!response.ok) {
+                throw new Error(response.statusText);
+            }
+            return response.arrayBuffer();
+        }).then(function(buffer) {
+            return that.decodeBinaryScene(buffer, undefined, firstId);
+        }).catch(function(err) {
+            console.error("Error loading binary scene: " + err);
+        });
+    }
+
+    /**
+     * Add the merged primitives written by Scene3D with setMergePrimitives,
+     * with one mesh per material
+     * 
+     * @param {ArrayBuffer} buffer The merged geometry
+     * @returns {array} The meshes that were added
+     */
+    decodeMergedGeometry(buffer) {
+        const view = new DataView(buffer);
+        const numGroups = view.getUint32(8, true);
+        let offset = 12;
+        const meshes = [];
+        for (let i = 0; i < numGroups; i++) {
+            let m = [];
+            for (let k = 0; k < 5; k++) {
+                m.push(view.getFloat64(offset, true));
+                offset += 8;
+            }
+            const nv = view.getUint32(offset, true);
+            const nt = view.getUint32(offset+4, true);
+            const indexSize = view.getUint32(offset+8, true);
+            offset += 12;
+            const geometry = new THREE.BufferGeometry();
+            geometry.setAttribute("position", new THREE.BufferAttribute(new Float32Array(buffer, offset, nv*3), 3));
+            offset += nv*12;
+            geometry.setAttribute("normal", new THREE.BufferAttribute(new Float32Array(buffer, offset, nv*3), 3));
+            offset += nv*12;
+            if (indexSize == 2) {
+                geometry.setIndex(new THREE.BufferAttribute(new Uint16Array(buffer, offset, nt*3), 1));
+                offset += Math.ceil(nt*6/4)*4;
+            }
+            else {
+                geometry.setIndex(new THREE.BufferAttribute(new Uint32Array(buffer, offset, nt*3), 1));
+                offset += nt*12;
+            }
+            const mesh = new THREE.Mesh(geometry, this.addMaterial(m[0], m[1], m[2], m[3], m[4]));
+            this.scene.add(mesh);
+            meshes.push(mesh);
+        }
+        return meshes;
+    }
+
+    /**
+     * Fetch the merged primitives written by Scene3D and add them
+     * 
+     * @param {string} url Path to the binary file, or a base64 data URL
+     */
+    loadMergedGeometry(url) {
+        const that = this;
+        return fetch(url).then(function(response) {
+            if (!response.ok) {
+                throw new Error(response.statusText);
+            }
+            return response.arrayBuffer();
+        }).then(function(buffer) {
+            return that.decodeMergedGeometry(buffer);
+        }).catch(function(err) {
+            console.error("Error loading merged geometry: " + err);
+        });
+    }
+
+    /**
+     * Fetch the manifest of a scene saved by Scene3D in chunks.  From then
+     * on, chunks are loaded as the camera comes within the load radius of
+     * them and dropped when it moves CHUNK_UNLOAD_FACTOR times as far away
+     * 
+     * @param {string} url Path to manifest.json in the chunk directory
+     */
+    loadChunkManifest(url) {
+        const that = this;
+        const base = url.substring(0, url.lastIndexOf("/") + 1);
+        return fetch(url).then(function(response) {
+            if (!response.ok) {
+                throw new Error(response.statusText);
+            }
+            return response.json();
+        }).then(function(manifest) {
+            that.chunkRadius = manifest.loadRadius;
+            that.chunks = manifest.chunks.map(function(c) {
+                return {url:base + c.file, min:c.min, max:c.max, group:null, loading:false, failed:false};
+            });
+            that.lastChunkPos = null;
+            that.updateChunks();
+        }).catch(function(err) {
+            console.error("Error loading chunk manifest: " + err);
+        });
+    }
+
+    /**
+     * Fetch one chunk and add everything in it to the scene in its own group
+     * 
+     * @param {object} chunk The chunk from the manifest
+     */
+    loadChunk(chunk) {
+        const that = this;
+        chunk.loading = true;
+        this.chunkLoads++;
+        fetch(chunk.url).then(function(response) {
+            if (!response.ok) {
+                throw new Error(response.statusText);
+            }
+            return response.arrayBuffer();
+        }).then(function(buffer) {
+            chunk.group = new THREE.Group();
+            that.decodeBinaryScene(buffer, chunk.group);
+            that.scene.add(chunk.group);
+        }).catch(function(err) {
+            console.error("Error loading chunk " + chunk.url + ": " + err);
+            chunk.failed = true;
+        }).finally(function() {
+            chunk.loading = false;
+            that.chunkLoads--;
+            // The camera may have moved while this was loading
+            that.lastChunkPos = null;
+        });
+    }
+
+    /**
+     * Remove a chunk from the scene and free the GPU buffers of its
+     * instances.  The geometry and materials are shared, so they are kept
+     * 
+     * @param {object} chunk The chunk from the manifest
+     */
+    unloadChunk(chunk) {
+        this.scene.remove(chunk.group);
+        chunk.group.unloaded = true; // For meshes that are still loading
+        chunk.group.traverse(function(child) {
+            if (child.isInstancedMesh) {
+                child.dispose();
+            }
+        });
+        this.lodBatches = this.lodBatches.filter(function(batch) {
+            return batch.parent !== chunk.group;
+        });
+        chunk.group = null;
+    }
+
+    /**
+     * Load the chunks near the camera, nearest first, and drop the ones that
+     * are far away.  Nothing is checked until the camera has moved a little
+     * or a load has finished
+     */
+    updateChunks() {
+        if (this.chunks.length == 0 || this.camera === null) {
+            return;
+        }
+        const pos = this.camera.pos;
+        const R = this.chunkRadius;
+        if (!(this.lastChunkPos === null) && glMatrix.vec3.distance(pos, this.lastChunkPos) < R/16) {
+            return;
+        }
+        this.lastChunkPos = glMatrix.vec3.clone(pos);
+        const near = [];
+        for (let c = 0; c < this.chunks.length; c++) {
+            const chunk = this.chunks[c];
+            let d2 = 0;
+            for (let k = 0; k < 3; k++) {
+                const e = Math.max(chunk.min[k] - pos[k], 0, pos[k] - chunk.max[k]);
+                d2 += e*e;
+            }
+            if (d2 <= R*R) {
+                if (chunk.group === null && !chunk.loading && !chunk.failed) {
+                    near.push([d2, chunk]);
+                }
+            }
+            else if (d2 > R*R*CHUNK_UNLOAD_FACTOR*CHUNK_UNLOAD_FACTOR && !(chunk.group === null)) {
+                this.unloadChunk(chunk);
+            }
+        }
+        near.sort(function(a, b) { return a[0] - b[0]; });
+        for (let i = 0; i < near.length && this.chunkLoads < CHUNK_MAX_LOADS; i++) {
+            this.loadChunk(near[i][1]);
+        }
+        if (near.length > 0) {
+            // Some chunks still have to wait their turn
+            this.lastChunkPos = null;
+        }
+    }
+
+    /////////////////////////////////////////////////////
+    //              PRECOMPUTED VISIBILITY             //
+    /////////////////////////////////////////////////////
+
+    /**
+     * Set aside ids for objects as they are added.  Scene3D numbers objects
+     * in the same order, so that it can say which ones each camera can see
+     *
+     * @param {int} n Number of objects
+     * @param {int} firstId Id to use for the first object, or undefined to
+     *                      use the next ones that haven't been set aside
+     * @returns {int} Id of the first object
+     */
+    reserveObjectIds(n, firstId) {
+        if (firstId === undefined) {
+            firstId = this.numObjectIds;
+            this.numObjectIds += n;
+        }
+        return firstId;
+    }
+
+    /**
+     * Keep track of objects with consecutive ids so that they can be
+     * shown and hidden by precomputed visibility
+     *
+     * @param {int} firstId Id of the first object
+     * @param {int} count Number of objects
+     * @param {array} objects Either one object, or instanced meshes with one
+     *                        instance per object
+     * @param {object} lodBatch The batch, as made by addInstancedMesh, if the
+     *                          objects are copies of a mesh with levels of detail
+     */
+    addVisibilityEntry(firstId, count, objects, lodBatch) {
+        const entry = {firstId:firstId, count:count, objects:objects, lodBatch:lodBatch};
+        this.visibilityEntries.push(entry);
+        if (!(this.visibleMask === null)) {
+            this.applyVisibility(entry);
+        }
+    }
+
+    isObjectVisible(id) {
+        const mask = this.visibleMask;
+        return mask === null || (id < mask.length && mask[id] == 1);
+    }
+
+    /**
+     * Show and hide the objects in an entry to match the current
+     * precomputed visibility.  Hidden instances are moved out of the
+     * instanced meshes, which are left out entirely if they're all hidden
+     *
+     * @param {object} entry The entry, as made by addVisibilityEntry
+     */
+    applyVisibility(entry) {
+        const that = this;
+        const batch = entry.lodBatch;
+        if (!(batch === null)) {
+            batch.hidden = null;
+            if (!(this.visibleMask === null)) {
+                batch.hidden = new Uint8Array(entry.count);
+                for (let i = 0; i < entry.count; i++) {
+                    batch.hidden[i] = this.isObjectVisible(entry.firstId + i) ? 0 : 1;
+                }
+            }
+            batch.lastPos = null;
+            this.updateLodBatch(batch);
+            return;
+        }
+        entry.objects.forEach(function(obj) {
+            if (!obj.isInstancedMesh) {
+                obj.visible = that.isObjectVisible(entry.firstId);
+                return;
+            }
+            if (obj.allMatrices === undefined) {
+                obj.allMatrices = obj.instanceMatrix.array.slice();
+            }
+            let n = 0;
+            for (let i = 0; i < entry.count; i++) {
+                if (that.isObjectVisible(entry.firstId + i)) {
+                    obj.instanceMatrix.array.set(obj.allMatrices.subarray(i*16, i*16+16), n*16);
+                    n++;
+                }
+            }
+            obj.count = n;
+            obj.visible = n > 0;
+            obj.instanceMatrix.needsUpdate = true;
         });
     }
 
+    /**
+     * Say which objects a camera can see from where it was placed, as
+     * worked out by Scene3D with setVisibilityCulling.  Only those are
+     * drawn while looking from that camera, until it moves
+     *
+     * @param {int} idx Index of the camera
+     * @param {array} runs The ids of the objects that can be seen, as
+     *                     pairs of (first id, number of ids)
+     */
+    setCameraVisibility(idx, runs) {
+        const c = this.cameras[idx];
+        c.visibility = {pos:glMatrix.vec3.clone(c.pos), runs:runs};
+    }
+
+    /**
+     * Switch to the precomputed visibility of the camera that's being looked
+     * from, if it has some and hasn't moved, or else show everything.  This
+     * is what hides objects when a different camera is chosen in the menu
+     */
+    updateVisibility() {
+        const c = this.camera;
+        let runs = null;
+        if (!(c === null || c.visibility === undefined) && glMatrix.vec3.distance(c.pos, c.visibility.pos) <= VISIBILITY_TOLERANCE) {
+            runs = c.visibility.runs;
+        }
+        if (runs === this.visibleRuns) {
+            return;
+        }
+        this.visibleRuns = runs;
+        this.visibleMask = null;
+        if (!(runs === null)) {
+            let n = 0;
+            for (let i = 0; i < runs.length; i += 2) {
+                n = Math.max(n, runs[i] + runs[i+1]);
+            }
+            this.visibleMask = new Uint8Array(n);
+            for (let i = 0; i < runs.length; i += 2) {
+                this.visibleMask.fill(1, runs[i], runs[i] + runs[i+1]);
+            }
+        }
+        for (let i = 0; i < this.visibilityEntries.length; i++) {
+            this.applyVisibility(this.visibilityEntries[i]);
+        }
+    }
+
     repaint() {
         // Redraw if walking
         let thisTime = (new Date()).getTime();
@@ -979,6 +1903,11 @@ class SceneCanvas {
             }
         }
 
+        this.updateChunks();
+        this.updateVisibility();
+        for (let i = 0; i < this.lodBatches.length; i++) {
+            this.updateLodBatch(this.lodBatches[i]);
+        }
         this.renderer.render(this.scene, this.camera.camera);
 
         if (this.animating) {